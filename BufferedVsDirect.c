@@ -11,18 +11,41 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <strings.h>
+
+#include "bench_common.h"
+#include "lat_hist.h"
+#include "aligned_pool.h"
+#include "workload.h"
+#include "io_stats.h"
 
 #ifndef __linux__
 #define O_DIRECT 0
 #endif
 
-static ssize_t read_all(int fd, void *buffer, size_t count) {
+/*
+ * each read() of at most `block` bytes is one timed op in `hist`; with `dio`
+ * set the fd is O_DIRECT and a chunk the device cannot take directly has its
+ * unaligned part served through the page cache
+ */
+static ssize_t read_all(int fd, void *buffer, size_t count, size_t block, struct lat_hist *hist,
+                        const struct dio_align *dio) {
     uint8_t *pointer = buffer;
     size_t left = count;
+    off_t pos = dio ? lseek(fd, 0, SEEK_CUR) : 0;
 
     while (left > 0) {
-        ssize_t bytes_read = read(fd, pointer, left);
+        size_t chunk = left < block ? left : block;
+        long long t0 = now_ns();
+        ssize_t bytes_read = dio ? dio_pread(fd, pointer, chunk, pos, dio) : read(fd, pointer, chunk);
+        lat_hist_record(hist, now_ns() - t0);
 
         if (bytes_read < 0) {
             if (errno == EINTR) continue;
@@ -31,30 +54,42 @@ static ssize_t read_all(int fd, void *buffer, size_t count) {
         if (bytes_read == 0) {
             break; // EOF
         }
+        stats_rw((uint64_t)bytes_read);
 
         left -= (size_t)bytes_read;
         pointer += bytes_read;
+        pos += bytes_read;
     }
 
+    if (dio) lseek(fd, pos, SEEK_SET);
     return (ssize_t)(count - left);
 }
 
-static ssize_t write_all(int fd, const void *buffer, size_t count, int do_fsync) {
+static ssize_t write_all(int fd, const void *buffer, size_t count, size_t block, struct lat_hist *hist,
+                         int do_fsync, const struct dio_align *dio) {
     const uint8_t *pointer = buffer;
     size_t left = count;
+    off_t pos = dio ? lseek(fd, 0, SEEK_CUR) : 0;
 
     while (left > 0) {
-        ssize_t bytes_written = write(fd, pointer, left);
+        size_t chunk = left < block ? left : block;
+        long long t0 = now_ns();
+        ssize_t bytes_written = dio ? dio_pwrite(fd, pointer, chunk, pos, dio) : write(fd, pointer, chunk);
+        lat_hist_record(hist, now_ns() - t0);
 
         if (bytes_written < 0) {
             if (errno == EINTR) continue;
             return -1;
         }
+        stats_rw((uint64_t)bytes_written);
         left -= (size_t)bytes_written;
         pointer += bytes_written;
+        pos += bytes_written;
     }
+    if (dio) lseek(fd, pos, SEEK_SET);
 
     if (do_fsync) {
+        stats_fsync();
         if (fsync(fd) < 0) {
             perror("fsync");
             exit(1);
@@ -69,20 +104,780 @@ static void fill_pattern(unsigned char *buffer, size_t length) {
     }
 }
 
-//calculate time difference in ns
-static long long elapsed_ns(struct timespec start, struct timespec end) {
-    return (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+/*
+ * Sweep mode: every (file size, block size) point is run `reps` times per
+ * mode, with the page cache for the file emptied before each trial, and the
+ * spread across trials is reported as CSV. Trials stream one block-sized
+ * buffer over the file, so file sizes larger than RAM work.
+ */
+
+#define SWEEP_MAX_POINTS 64
+
+struct sweep_opts {
+    uint64_t blocks[SWEEP_MAX_POINTS];
+    int nblocks;
+    uint64_t sizes[SWEEP_MAX_POINTS];
+    int nsizes;
+    int reps;
+    int drop_caches; // also drop the whole page cache between trials (root only)
+};
+
+static uint64_t phys_ram_bytes(void) {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page = sysconf(_SC_PAGESIZE);
+    return pages > 0 && page > 0 ? (uint64_t)pages * (uint64_t)page : 0;
+}
+
+/*
+ * "4K,64K,1M" or doubling ranges "4K-16M"; sizes may also be "2xRAM".
+ * Returns the number of values, -1 on junk.
+ */
+static int parse_size_list(const char *arg, uint64_t *out, int max) {
+    char *copy = strdup(arg);
+    int n = 0;
+    for (char *tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+        uint64_t lo, hi;
+        char *dash = strchr(tok, '-');
+        size_t len = strlen(tok);
+
+        if (len > 4 && strcasecmp(tok + len - 4, "xram") == 0) {
+            double mult = strtod(tok, NULL);
+            uint64_t ram = phys_ram_bytes();
+            if (mult <= 0 || ram == 0 || n == max) goto bad;
+            out[n++] = (uint64_t)(mult * (double)ram);
+            continue;
+        }
+        if (dash) {
+            *dash = '\0';
+            if (parse_size(tok, &lo) < 0 || parse_size(dash + 1, &hi) < 0 || lo == 0 || hi < lo) goto bad;
+        } else {
+            if (parse_size(tok, &lo) < 0 || lo == 0) goto bad;
+            hi = lo;
+        }
+        for (uint64_t v = lo; v <= hi; v *= 2) {
+            if (n == max) goto bad;
+            out[n++] = v;
+        }
+    }
+    free(copy);
+    return n;
+bad:
+    free(copy);
+    return -1;
+}
+
+/* flush the file and push its pages out of the cache so the next trial starts cold */
+static const char *evict_cache(const char *filename, int drop_caches) {
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+#ifdef __linux__
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        close(fd);
+    }
+    if (drop_caches) {
+        sync();
+        int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
+        if (dc >= 0 && write(dc, "3", 1) == 1) {
+            close(dc);
+            return "drop_caches";
+        }
+        if (dc >= 0) close(dc);
+    }
+    return "fadvise";
+}
+
+enum io_mode {
+    MODE_BUFFERED,
+    MODE_DIRECT,
+    MODE_MMAP
+};
+
+/* how a MODE_MMAP trial maps the file */
+struct map_opts {
+    int populate; // MAP_POPULATE: fault everything in at mmap time
+    int advice;   // MADV_* applied to the whole mapping, -1 for none
+};
+
+struct trial_mode {
+    enum io_mode mode;
+    struct map_opts map;
+    char label[32];
+};
+
+struct trial_result {
+    long long ns;
+    long minflt; // page faults served from the cache
+    long majflt; // page faults that waited for the device
+};
+
+#define MAX_MMAP_VARIANTS 16
+
+/*
+ * "demand", "populate", optionally with "+seq", "+willneed" or "+huge",
+ * comma separated. Returns the number of variants, -1 on junk.
+ */
+static int parse_mmap_variants(const char *arg, struct trial_mode *out, int max) {
+    char *copy = strdup(arg);
+    int n = 0;
+    for (char *tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+        if (n == max) goto bad;
+        struct trial_mode *m = &out[n++];
+        memset(m, 0, sizeof(*m));
+        m->mode = MODE_MMAP;
+        m->map.advice = -1;
+        snprintf(m->label, sizeof(m->label), "mmap-%s", tok);
+
+        char *plus = strchr(tok, '+');
+        if (plus) *plus++ = '\0';
+        if (strcmp(tok, "populate") == 0) m->map.populate = 1;
+        else if (strcmp(tok, "demand") != 0) goto bad;
+
+        if (!plus) continue;
+        if (strcmp(plus, "seq") == 0) m->map.advice = MADV_SEQUENTIAL;
+        else if (strcmp(plus, "willneed") == 0) m->map.advice = MADV_WILLNEED;
+#ifdef MADV_HUGEPAGE
+        else if (strcmp(plus, "huge") == 0) m->map.advice = MADV_HUGEPAGE;
+#endif
+        else goto bad;
+    }
+    free(copy);
+    return n;
+bad:
+    free(copy);
+    return -1;
+}
+
+/*
+ * mmap pass: each block is one memcpy into or out of the mapping, timed like
+ * a read()/write() call, so the page faults land in the per-op latencies.
+ * Writes size the file first and end with msync(MS_SYNC) in place of fsync.
+ */
+static int mmap_pass(int fd, int is_write, const struct map_opts *mo, void *buf,
+                     uint64_t bytes, size_t block, struct lat_hist *hist) {
+    if (is_write && ftruncate(fd, (off_t)bytes) < 0) {
+        perror("ftruncate");
+        return -1;
+    }
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (mo->populate) flags |= MAP_POPULATE;
+#endif
+    unsigned char *map = mmap(NULL, bytes, is_write ? PROT_READ | PROT_WRITE : PROT_READ, flags, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    if (mo->advice >= 0 && madvise(map, bytes, mo->advice) < 0) {
+        perror("madvise");
+    }
+
+    for (uint64_t off = 0; off < bytes; off += block) {
+        long long t0 = now_ns();
+        if (is_write) memcpy(map + off, buf, block);
+        else memcpy(buf, map + off, block);
+        lat_hist_record(hist, now_ns() - t0);
+    }
+    stats_ops(bytes / block, bytes / block * block);
+
+    int rc = 0;
+    if (is_write) stats_fsync();
+    if (is_write && msync(map, bytes, MS_SYNC) < 0) {
+        perror("msync");
+        rc = -1;
+    }
+    munmap(map, bytes);
+    return rc;
+}
+
+/* one timed pass over the first `bytes` of the file */
+static int run_trial(const char *filename, int is_write, const struct trial_mode *tm, void *buf,
+                     uint64_t bytes, size_t block, const struct dio_align *dio, struct lat_hist *hist,
+                     struct trial_result *res) {
+    if (tm->mode != MODE_DIRECT) dio = NULL;
+    int flags = is_write ? (O_CREAT | O_TRUNC | (tm->mode == MODE_MMAP ? O_RDWR : O_WRONLY)) : O_RDONLY;
+    if (tm->mode == MODE_DIRECT) flags |= O_DIRECT;
+    int fd = open(filename, flags, 0644);
+    if (fd < 0) {
+        perror(tm->mode == MODE_DIRECT ? "open O_DIRECT" : "open");
+        return -1;
+    }
+
+    char phase[STATS_NAME_MAX];
+    snprintf(phase, sizeof(phase), "%s %s", tm->label, is_write ? "write" : "read");
+    stats_phase(phase);
+
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_SELF, &ru0);
+    long long t0 = now_ns();
+
+    if (tm->mode == MODE_MMAP) {
+        if (mmap_pass(fd, is_write, &tm->map, buf, bytes, block, hist) < 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        for (uint64_t done = 0; done < bytes; done += block) {
+            ssize_t n = is_write ? write_all(fd, buf, block, block, hist, 0, dio)
+                                 : read_all(fd, buf, block, block, hist, dio);
+            if (n != (ssize_t)block) {
+                fprintf(stderr, "%s %s: %s\n", tm->label, is_write ? "write" : "read",
+                        n < 0 ? strerror(errno) : "short transfer");
+                close(fd);
+                return -1;
+            }
+        }
+        if (is_write) stats_fsync();
+        if (is_write && fsync(fd) < 0) {
+            perror("fsync");
+            close(fd);
+            return -1;
+        }
+    }
+
+    res->ns = now_ns() - t0;
+    getrusage(RUSAGE_SELF, &ru1);
+    res->minflt = ru1.ru_minflt - ru0.ru_minflt;
+    res->majflt = ru1.ru_majflt - ru0.ru_majflt;
+    close(fd);
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of an ascending array */
+static double sample_percentile(const double *v, int n, double p) {
+    int rank = (int)(p / 100.0 * n + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return v[rank - 1];
+}
+
+static int run_sweep(const char *filename, const struct sweep_opts *o, const struct trial_mode *modes,
+                     int nmodes, FILE *csv) {
+    uint64_t max_block = 0;
+    for (int i = 0; i < o->nblocks; i++)
+        if (o->blocks[i] > max_block) max_block = o->blocks[i];
+
+    struct dio_align dio;
+    struct buf_pool pool;
+    dio_align_discover_path(filename, &dio);
+    fprintf(stderr, "O_DIRECT alignment: memory %zu, offset %zu (%s)\n", dio.mem_align, dio.offset_align,
+            dio.source);
+    for (int i = 0; i < o->nblocks; i++) {
+        if (o->blocks[i] % dio.offset_align != 0)
+            fprintf(stderr, "block %llu is not a multiple of %zu; direct trials send the unaligned part "
+                            "through the page cache\n", (unsigned long long)o->blocks[i], dio.offset_align);
+    }
+    if (buf_pool_init(&pool, 1, max_block, dio.mem_align) < 0) {
+        perror("buffer pool");
+        return -1;
+    }
+    void *buf = buf_pool_get(&pool);
+    fill_pattern(buf, max_block);
+    double *mbps = calloc((size_t)o->reps, sizeof(*mbps));
+    if (!mbps) {
+        perror("calloc");
+        buf_pool_destroy(&pool);
+        return -1;
+    }
+    static struct lat_hist hist;
+
+    int drop = o->drop_caches;
+    if (drop && geteuid() != 0) {
+        fprintf(stderr, "--drop-caches needs root; evicting with fadvise only\n");
+        drop = 0;
+    }
+
+    fprintf(csv, "op,mode,file_size,block_size,bytes,reps,mean_mbps,stddev_mbps,min_mbps,"
+                 "p50_mbps,p90_mbps,max_mbps,op_p50_ns,op_p99_ns,op_p999_ns,minflt,majflt,cache\n");
+
+    for (int s = 0; s < o->nsizes; s++) {
+        for (int b = 0; b < o->nblocks; b++) {
+            size_t block = (size_t)o->blocks[b];
+            uint64_t bytes = o->sizes[s] / block * block;
+            if (bytes == 0) {
+                fprintf(stderr, "skipping block %zu: larger than file size %llu\n",
+                        block, (unsigned long long)o->sizes[s]);
+                continue;
+            }
+
+            // writes first: they leave the file at full size for the reads
+            for (int op = 1; op >= 0; op--) {
+                for (int mi = 0; mi < nmodes; mi++) {
+                    const char *cache = "fadvise";
+                    long minflt = 0, majflt = 0;
+                    lat_hist_init(&hist);
+                    for (int r = 0; r < o->reps; r++) {
+                        struct trial_result tr;
+                        cache = evict_cache(filename, drop);
+                        if (run_trial(filename, op, &modes[mi], buf, bytes, block, &dio, &hist, &tr) < 0) {
+                            free(mbps);
+                            buf_pool_destroy(&pool);
+                            return -1;
+                        }
+                        mbps[r] = (double)bytes / (1024.0 * 1024.0) / ((double)tr.ns / 1e9);
+                        minflt += tr.minflt;
+                        majflt += tr.majflt;
+                    }
+
+                    double sum = 0, sq = 0;
+                    for (int r = 0; r < o->reps; r++) sum += mbps[r];
+                    double mean = sum / o->reps;
+                    for (int r = 0; r < o->reps; r++) sq += (mbps[r] - mean) * (mbps[r] - mean);
+                    double stddev = o->reps > 1 ? sqrt(sq / (o->reps - 1)) : 0;
+                    qsort(mbps, (size_t)o->reps, sizeof(*mbps), cmp_double);
+
+                    // fault counts are per trial, averaged over the reps
+                    fprintf(csv, "%s,%s,%llu,%zu,%llu,%d,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%lld,%lld,%lld,%ld,%ld,%s\n",
+                            op ? "write" : "read", modes[mi].label,
+                            (unsigned long long)o->sizes[s], block, (unsigned long long)bytes, o->reps,
+                            mean, stddev, mbps[0], sample_percentile(mbps, o->reps, 50),
+                            sample_percentile(mbps, o->reps, 90), mbps[o->reps - 1],
+                            lat_hist_percentile(&hist, 50.0), lat_hist_percentile(&hist, 99.0),
+                            lat_hist_percentile(&hist, 99.9), minflt / o->reps, majflt / o->reps, cache);
+                    fflush(csv);
+                }
+            }
+        }
+    }
+
+    free(mbps);
+    buf_pool_destroy(&pool);
+    return 0;
+}
+
+/*
+ * Saturation mode: N pinned threads doing O_DIRECT pread or pwrite, each
+ * sequentially over its own region (disjoint slices of one file, or one file
+ * per thread), for a fixed time per step. N doubles until throughput stops
+ * improving.
+ */
+
+#define SAT_PLATEAU_GAIN 1.05 // a step must beat the best so far by 5% to count as progress
+#define SAT_PLATEAU_STEPS 2   // stop after this many steps without progress
+
+struct sat_opts {
+    int max_threads;
+    int separate_files; // one file per thread instead of slices of one file
+    int is_write;
+    size_t block;
+    uint64_t region;    // bytes each thread cycles over
+    double step_secs;
+};
+
+struct sat_thread {
+    pthread_t tid;
+    int cpu;            // -1: not pinned
+    int fd;
+    off_t base;         // start of this thread's region
+    uint64_t region;
+    size_t block;
+    int is_write;
+    void *buf;
+    pthread_mutex_t *gate;      // held by the main thread until `start` is sized
+    pthread_barrier_t *start;
+    volatile int *stop;
+    uint64_t ops;
+    int failed;
+    struct lat_hist hist;
+};
+
+static void *sat_worker(void *arg) {
+    struct sat_thread *t = arg;
+#ifdef __linux__
+    if (t->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(t->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+    pthread_mutex_lock(t->gate);
+    pthread_mutex_unlock(t->gate);
+    pthread_barrier_wait(t->start);
+
+    uint64_t off = 0;
+    while (!__atomic_load_n(t->stop, __ATOMIC_RELAXED)) {
+        long long t0 = now_ns();
+        ssize_t n = t->is_write ? pwrite(t->fd, t->buf, t->block, t->base + (off_t)off)
+                                : pread(t->fd, t->buf, t->block, t->base + (off_t)off);
+        lat_hist_record(&t->hist, now_ns() - t0);
+        if (n != (ssize_t)t->block) {
+            if (n < 0 && errno == EINTR) continue;
+            fprintf(stderr, "thread on cpu %d: %s: %s\n", t->cpu, t->is_write ? "pwrite" : "pread",
+                    n < 0 ? strerror(errno) : "short transfer");
+            t->failed = 1;
+            break;
+        }
+        t->ops++;
+        off += t->block;
+        if (off + t->block > t->region) off = 0;
+    }
+    return NULL;
+}
+
+static void sat_file_name(char *out, size_t len, const char *filename, int i, int separate) {
+    if (separate) snprintf(out, len, "%s.%d", filename, i);
+    else snprintf(out, len, "%s", filename);
+}
+
+static int run_saturation(const char *filename, const struct sat_opts *o, FILE *csv) {
+    struct dio_align dio;
+    dio_align_discover_path(filename, &dio);
+    if (o->block % dio.offset_align != 0) {
+        fprintf(stderr, "block %zu is not a multiple of the %zu-byte O_DIRECT alignment (%s)\n",
+                o->block, dio.offset_align, dio.source);
+        return -1;
+    }
+    uint64_t region = o->region / o->block * o->block;
+    if (region < o->block) region = o->block;
+
+    // the CPUs this process may run on; thread i is pinned to the i-th one, wrapping
+    int cpus[CPU_SETSIZE];
+    int ncpus = 0;
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &allowed)) cpus[ncpus++] = c;
+    }
+#endif
+
+    // every region holds real data before the first step so reads never hit holes
+    char path[4096];
+    int nfiles = o->separate_files ? o->max_threads : 1;
+    for (int i = 0; i < nfiles; i++) {
+        sat_file_name(path, sizeof(path), filename, i, o->separate_files);
+        if (prefill_file(path, o->separate_files ? region : region * (uint64_t)o->max_threads) < 0) return -1;
+    }
+
+    struct sat_thread *th = calloc((size_t)o->max_threads, sizeof(*th));
+    struct buf_pool pool;
+    if (!th || buf_pool_init(&pool, (unsigned)o->max_threads, o->block, dio.mem_align) < 0) {
+        perror("alloc");
+        free(th);
+        return -1;
+    }
+    for (int i = 0; i < o->max_threads; i++) {
+        th[i].buf = buf_pool_get(&pool);
+        fill_pattern(th[i].buf, o->block);
+    }
+    static struct lat_hist all;
+
+    printf("O_DIRECT %s saturation on %s: block %zu, region %llu per thread, %s, %.1f s per step\n",
+           o->is_write ? "write" : "read", filename, o->block, (unsigned long long)region,
+           o->separate_files ? "one file per thread" : "disjoint slices of one file", o->step_secs);
+    printf("%8s %12s %12s %10s %10s %10s\n", "threads", "MB/s", "IOPS", "p50_ns", "p99_ns", "p99.9_ns");
+    if (csv) fprintf(csv, "threads,mbps,iops,lat_p50_ns,lat_p99_ns,lat_p999_ns,lat_max_ns\n");
+
+    double best = 0, best_nthreads = 0;
+    double step_mbps[64];
+    int step_n[64], nsteps = 0, stale = 0, rc = 0;
+
+    for (int n = 1; nsteps < 64; n = n * 2 < o->max_threads ? n * 2 : o->max_threads) {
+        pthread_barrier_t start;
+        pthread_mutex_t gate = PTHREAD_MUTEX_INITIALIZER;
+        volatile int stop = 0;
+        int started = 0, err;
+        char phase[STATS_NAME_MAX];
+        snprintf(phase, sizeof(phase), "saturate %d", n);
+        stats_phase(phase);
+
+        // workers wait on the gate, so the barrier can be sized once we know how many started
+        pthread_mutex_lock(&gate);
+        for (int i = 0; i < n; i++) {
+            struct sat_thread *t = &th[i];
+            sat_file_name(path, sizeof(path), filename, i, o->separate_files);
+            t->fd = open(path, (o->is_write ? O_WRONLY : O_RDONLY) | O_DIRECT);
+            if (t->fd < 0) {
+                perror("open O_DIRECT");
+                rc = -1;
+                break;
+            }
+            t->cpu = ncpus ? cpus[i % ncpus] : -1;
+            t->base = o->separate_files ? 0 : (off_t)(region * (uint64_t)i);
+            t->region = region;
+            t->block = o->block;
+            t->is_write = o->is_write;
+            t->gate = &gate;
+            t->start = &start;
+            t->stop = &stop;
+            t->ops = 0;
+            t->failed = 0;
+            lat_hist_init(&t->hist);
+            if ((err = pthread_create(&t->tid, NULL, sat_worker, t)) != 0) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err));
+                close(t->fd);
+                rc = -1;
+                break;
+            }
+            started++;
+        }
+        pthread_barrier_init(&start, NULL, (unsigned)started + 1);
+        pthread_mutex_unlock(&gate);
+
+        if (rc < 0) {
+            // let the threads that did start through the barrier straight into the stop check
+            __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+            pthread_barrier_wait(&start);
+            for (int i = 0; i < started; i++) {
+                pthread_join(th[i].tid, NULL);
+                close(th[i].fd);
+            }
+            pthread_barrier_destroy(&start);
+            pthread_mutex_destroy(&gate);
+            goto out;
+        }
+
+        pthread_barrier_wait(&start);
+        long long t0 = now_ns();
+        struct timespec step = {(time_t)o->step_secs, (long)((o->step_secs - (double)(time_t)o->step_secs) * 1e9)};
+        nanosleep(&step, NULL);
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+        uint64_t ops = 0;
+        int failed = 0;
+        lat_hist_init(&all);
+        for (int i = 0; i < n; i++) {
+            pthread_join(th[i].tid, NULL);
+            close(th[i].fd);
+            ops += th[i].ops;
+            failed |= th[i].failed;
+            lat_hist_merge(&all, &th[i].hist);
+        }
+        double secs = (double)(now_ns() - t0) / 1e9;
+        pthread_barrier_destroy(&start);
+        pthread_mutex_destroy(&gate);
+        stats_ops(ops, ops * o->block);
+        stats_syscalls(ops);
+        if (failed) {
+            rc = -1;
+            goto out;
+        }
+
+        double mbps = (double)ops * (double)o->block / (1024.0 * 1024.0) / secs;
+        printf("%8d %12.2f %12.0f %10lld %10lld %10lld\n", n, mbps, (double)ops / secs,
+               lat_hist_percentile(&all, 50.0), lat_hist_percentile(&all, 99.0), lat_hist_percentile(&all, 99.9));
+        if (csv) fprintf(csv, "%d,%.2f,%.0f,%lld,%lld,%lld,%lld\n", n, mbps, (double)ops / secs,
+                         lat_hist_percentile(&all, 50.0), lat_hist_percentile(&all, 99.0),
+                         lat_hist_percentile(&all, 99.9), all.max_ns);
+        fflush(stdout);
+
+        step_mbps[nsteps] = mbps;
+        step_n[nsteps++] = n;
+        if (mbps > best * SAT_PLATEAU_GAIN) {
+            stale = 0;
+        } else if (++stale >= SAT_PLATEAU_STEPS) {
+            break;
+        }
+        if (mbps > best) {
+            best = mbps;
+            best_nthreads = n;
+        }
+        if (n == o->max_threads) break;
+    }
+
+    // the saturation point: fewest threads that get within 5% of the best step
+    for (int s = 0; s < nsteps; s++) {
+        if (step_mbps[s] * SAT_PLATEAU_GAIN >= best) {
+            printf("saturation: %d threads, %.2f MB/s (peak %.2f MB/s at %.0f threads)\n",
+                   step_n[s], step_mbps[s], best, best_nthreads);
+            break;
+        }
+    }
+
+out:
+    buf_pool_destroy(&pool);
+    free(th);
+    return rc;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] [file] [block_size] [total_size]\n"
+            "       %s --sweep [options] [file]\n"
+            "  --mmap[=LIST]     also run mmap variants: demand or populate, optionally +seq,\n"
+            "                    +willneed or +huge (default demand,populate,demand+seq,\n"
+            "                    demand+willneed,demand+huge)\n"
+            "  --sweep           run every block size x file size point for each mode\n"
+            "  --blocks LIST     block sizes, e.g. 4K,64K or 4K-16M doubling (default 4K-16M)\n"
+            "  --sizes LIST      file sizes, same syntax, or 2xRAM (default 256M)\n"
+            "  --reps R          trials per point (default 5)\n"
+            "  --drop-caches     also drop the page cache between trials (root only)\n"
+            "  --csv FILE        write results to FILE instead of stdout\n"
+            "  --saturate        ramp O_DIRECT threads (1, 2, 4, ...) until throughput plateaus\n"
+            "  --max-threads N   largest step (default: CPUs available)\n"
+            "  --files           one file per thread (file.N) instead of slices of one file\n"
+            "  --op read|write   saturation op (default read)\n"
+            "  --bs SIZE         saturation block size (default 4K)\n"
+            "  --region SIZE     bytes each thread cycles over (default 64M)\n"
+            "  --step-secs S     duration of each step (default 2)\n",
+            prog, prog);
 }
 
 int main(int argc, char **argv) {
     const char *filename = "BufferedVsDirect.txt";
-    if (argc >= 2) {
-        filename = argv[1];
+    int sweep = 0;
+    const char *csv_path = NULL;
+    struct sweep_opts so;
+    memset(&so, 0, sizeof(so));
+    so.reps = 5;
+    // buffered and O_DIRECT always run; --mmap appends its variants
+    struct trial_mode modes[2 + MAX_MMAP_VARIANTS] = {
+        {.mode = MODE_BUFFERED, .label = "buffered"},
+        {.mode = MODE_DIRECT, .label = "direct"},
+    };
+    int nmodes = 2;
+    int saturate = 0;
+    struct sat_opts sat = {.block = 4096, .region = 64ULL << 20, .step_secs = 2.0};
+
+    static const struct option long_opts[] = {
+        {"sweep",       no_argument,       NULL, 'w'},
+        {"blocks",      required_argument, NULL, 'b'},
+        {"sizes",       required_argument, NULL, 's'},
+        {"reps",        required_argument, NULL, 'r'},
+        {"drop-caches", no_argument,       NULL, 'D'},
+        {"csv",         required_argument, NULL, 'c'},
+        {"mmap",        optional_argument, NULL, 'm'},
+        {"saturate",    no_argument,       NULL, 'S'},
+        {"max-threads", required_argument, NULL, 'T'},
+        {"files",       no_argument,       NULL, 'F'},
+        {"op",          required_argument, NULL, 'o'},
+        {"bs",          required_argument, NULL, 'B'},
+        {"region",      required_argument, NULL, 'R'},
+        {"step-secs",   required_argument, NULL, 't'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "wb:s:r:Dc:m::ST:Fo:B:R:t:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'w': sweep = 1; break;
+        case 'b':
+            so.nblocks = parse_size_list(optarg, so.blocks, SWEEP_MAX_POINTS);
+            if (so.nblocks <= 0) {
+                fprintf(stderr, "bad block size list: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            so.nsizes = parse_size_list(optarg, so.sizes, SWEEP_MAX_POINTS);
+            if (so.nsizes <= 0) {
+                fprintf(stderr, "bad file size list: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            so.reps = atoi(optarg);
+            if (so.reps < 1) so.reps = 1;
+            break;
+        case 'D': so.drop_caches = 1; break;
+        case 'c': csv_path = optarg; break;
+        case 'm': {
+            int n = parse_mmap_variants(optarg ? optarg : "demand,populate,demand+seq,demand+willneed,demand+huge",
+                                        modes + 2, MAX_MMAP_VARIANTS);
+            if (n <= 0) {
+                fprintf(stderr, "bad mmap variant list: %s\n", optarg);
+                return 1;
+            }
+            nmodes = 2 + n;
+            break;
+        }
+        case 'S': saturate = 1; break;
+        case 'T': sat.max_threads = atoi(optarg); break;
+        case 'F': sat.separate_files = 1; break;
+        case 'o':
+            if (strcmp(optarg, "read") == 0) sat.is_write = 0;
+            else if (strcmp(optarg, "write") == 0) sat.is_write = 1;
+            else {
+                fprintf(stderr, "op must be read or write\n");
+                return 1;
+            }
+            break;
+        case 'B':
+        case 'R': {
+            uint64_t v;
+            if (parse_size(optarg, &v) < 0 || v == 0) {
+                fprintf(stderr, "bad size: %s\n", optarg);
+                return 1;
+            }
+            if (opt == 'B') sat.block = (size_t)v;
+            else sat.region = v;
+            break;
+        }
+        case 't':
+            sat.step_secs = strtod(optarg, NULL);
+            if (sat.step_secs <= 0) sat.step_secs = 2.0;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (argc - optind >= 1) {
+        filename = argv[optind];
+    }
+    stats_init(argv[0], "setup");
+
+    if (saturate) {
+        if (sat.max_threads <= 0) {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            sat.max_threads = n > 0 ? (int)n : 1;
+        }
+        FILE *csv = NULL;
+        if (csv_path && !(csv = fopen(csv_path, "w"))) {
+            perror("open csv");
+            return 1;
+        }
+        int rc = run_saturation(filename, &sat, csv);
+        if (csv) fclose(csv);
+        return rc < 0 ? 1 : 0;
+    }
+
+    if (sweep) {
+        if (so.nblocks == 0) so.nblocks = parse_size_list("4K-16M", so.blocks, SWEEP_MAX_POINTS);
+        if (so.nsizes == 0) so.nsizes = parse_size_list("256M", so.sizes, SWEEP_MAX_POINTS);
+        FILE *csv = stdout;
+        if (csv_path && !(csv = fopen(csv_path, "w"))) {
+            perror("open csv");
+            return 1;
+        }
+        int rc = run_sweep(filename, &so, modes, nmodes, csv);
+        if (csv != stdout) fclose(csv);
+        return rc < 0 ? 1 : 0;
     }
 
     size_t write_size = 4096 * 1024; 
+    size_t block_size = 0; // 0: the whole buffer in one syscall
+
+    if (argc - optind >= 2) {
+        uint64_t v;
+        if (parse_size(argv[optind + 1], &v) < 0 || v == 0) {
+            fprintf(stderr, "bad block size: %s\n", argv[optind + 1]);
+            return 1;
+        }
+        block_size = (size_t)v;
+    }
+    if (argc - optind >= 3) {
+        uint64_t v;
+        if (parse_size(argv[optind + 2], &v) < 0 || v == 0) {
+            fprintf(stderr, "bad total size: %s\n", argv[optind + 2]);
+            return 1;
+        }
+        write_size = (size_t)v;
+    }
+    if (block_size == 0 || block_size > write_size) {
+        block_size = write_size;
+    }
 
     struct timespec t1, t2;
+    static struct lat_hist hist;
 
     // Buffered write 
     int fd_buffer = open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0644);
@@ -98,8 +893,10 @@ int main(int argc, char **argv) {
     }
     fill_pattern(buffer, write_size);
 
+    stats_phase("buffered write");
+    lat_hist_init(&hist);
     clock_gettime(CLOCK_MONOTONIC, &t1);
-    ssize_t buffered_write = write_all(fd_buffer, buffer, write_size, 1);
+    ssize_t buffered_write = write_all(fd_buffer, buffer, write_size, block_size, &hist, 1, NULL);
     clock_gettime(CLOCK_MONOTONIC, &t2);
 
     if (buffered_write != (ssize_t)write_size) {
@@ -110,24 +907,35 @@ int main(int argc, char **argv) {
     close(fd_buffer);
 
     printf("Buffered write time: %lld ns\n", elapsed_ns(t1, t2));
+    lat_hist_print(stdout, "  Buffered write per-op", &hist);
 
     // Direct write 
     int fd_direct = open(filename, O_CREAT | O_WRONLY | O_TRUNC | O_DIRECT, 0644);
     if (fd_direct < 0) {
         perror("open O_DIRECT");
-        fprintf(stderr, "O_DIRECT may have failed due to alignment issues.\n");
+        if (errno == EINVAL) fprintf(stderr, "this filesystem does not support O_DIRECT\n");
         return 1;
     }
 
-    void *dbuffer = NULL;
-    if (posix_memalign(&dbuffer, 4096, write_size) != 0) {
-        perror("posix_memalign");
+    // alignment the file really needs; both direct buffers come pre-faulted from one pool
+    struct dio_align dio;
+    dio_align_discover(fd_direct, &dio);
+    printf("O_DIRECT alignment: memory %zu, offset %zu (%s)\n", dio.mem_align, dio.offset_align, dio.source);
+    if (block_size % dio.offset_align != 0 || write_size % dio.offset_align != 0) {
+        printf("  unaligned block or tail: that part goes through the page cache\n");
+    }
+    struct buf_pool dio_pool;
+    if (buf_pool_init(&dio_pool, 2, write_size, dio.mem_align) < 0) {
+        perror("buffer pool");
         return 1;
     }
+    void *dbuffer = buf_pool_get(&dio_pool);
     fill_pattern((unsigned char *)dbuffer, write_size);
 
+    stats_phase("direct write");
+    lat_hist_init(&hist);
     clock_gettime(CLOCK_MONOTONIC, &t1);
-    ssize_t direct_write = write_all(fd_direct, dbuffer, write_size, 1);
+    ssize_t direct_write = write_all(fd_direct, dbuffer, write_size, block_size, &hist, 1, &dio);
     clock_gettime(CLOCK_MONOTONIC, &t2);
 
     if (direct_write != (ssize_t)write_size) {
@@ -138,6 +946,7 @@ int main(int argc, char **argv) {
     close(fd_direct);
 
     printf("Direct write time:   %lld ns\n", elapsed_ns(t1, t2));
+    lat_hist_print(stdout, "  Direct write per-op", &hist);
 
     //  Buffered read 
     int fd_rbuf = open(filename, O_RDONLY);
@@ -156,8 +965,10 @@ int main(int argc, char **argv) {
     posix_fadvise(fd_rbuf, 0, 0, POSIX_FADV_DONTNEED);
 #endif
 
+    stats_phase("buffered read");
+    lat_hist_init(&hist);
     clock_gettime(CLOCK_MONOTONIC, &t1);
-    ssize_t buffered_read = read_all(fd_rbuf, read_buffer, write_size);
+    ssize_t buffered_read = read_all(fd_rbuf, read_buffer, write_size, block_size, &hist, NULL);
     clock_gettime(CLOCK_MONOTONIC, &t2);
 
     if (buffered_read != (ssize_t)write_size) {
@@ -168,6 +979,7 @@ int main(int argc, char **argv) {
     close(fd_rbuf);
 
     printf("Buffered read time:  %lld ns\n", elapsed_ns(t1, t2));
+    lat_hist_print(stdout, "  Buffered read per-op", &hist);
 
     // Direct read 
     int fd_rdirect = open(filename, O_RDONLY | O_DIRECT);
@@ -176,14 +988,12 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    void *rd_buffer = NULL;
-    if (posix_memalign(&rd_buffer, 4096, write_size) != 0) {
-        perror("posix_memalign rdbuffer");
-        return 1;
-    }
+    void *rd_buffer = buf_pool_get(&dio_pool);
 
+    stats_phase("direct read");
+    lat_hist_init(&hist);
     clock_gettime(CLOCK_MONOTONIC, &t1);
-    ssize_t direct_read = read_all(fd_rdirect, rd_buffer, write_size);
+    ssize_t direct_read = read_all(fd_rdirect, rd_buffer, write_size, block_size, &hist, &dio);
     clock_gettime(CLOCK_MONOTONIC, &t2);
 
     if (direct_read != (ssize_t)write_size) {
@@ -194,12 +1004,30 @@ int main(int argc, char **argv) {
     close(fd_rdirect);
 
     printf("Direct read time:    %lld ns\n", elapsed_ns(t1, t2));
+    lat_hist_print(stdout, "  Direct read per-op", &hist);
+
+    // mmap variants: same block size, cold cache before each pass
+    for (int mi = 2; mi < nmodes; mi++) {
+        for (int op = 1; op >= 0; op--) {
+            struct trial_result tr;
+            char label[64];
+            evict_cache(filename, 0);
+            lat_hist_init(&hist);
+            if (run_trial(filename, op, &modes[mi], buffer, write_size / block_size * block_size,
+                          block_size, &dio, &hist, &tr) < 0) {
+                return 1;
+            }
+            printf("%s %s time: %lld ns, faults: %ld minor, %ld major\n", modes[mi].label,
+                   op ? "write" : "read", tr.ns, tr.minflt, tr.majflt);
+            snprintf(label, sizeof(label), "  %s %s per-op", modes[mi].label, op ? "write" : "read");
+            lat_hist_print(stdout, label, &hist);
+        }
+    }
 
     // cleanup
     free(buffer);
-    free(dbuffer);
     free(read_buffer);
-    free(rd_buffer);
+    buf_pool_destroy(&dio_pool);
 
     printf("Done\n");
     return 0;
@@ -0,0 +1,259 @@
+#ifndef ALIGNED_POOL_H
+#define ALIGNED_POOL_H
+
+/*
+ * O_DIRECT support shared by the benchmarks: the alignment a file really
+ * needs, a pool of pre-faulted buffers that satisfy it, and pread/pwrite
+ * wrappers that push an unaligned tail through the page cache instead of
+ * failing with EINVAL.
+ *
+ * Alignment comes from statx(STATX_DIOALIGN) (Linux 6.1+), then the logical
+ * block size of the backing device (BLKSSZGET), then the filesystem block
+ * size, so 512e and 4Kn devices both get the value they actually enforce.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+#define DIO_DEFAULT_ALIGN 4096
+
+struct dio_align {
+    size_t mem_align;    // buffer address alignment
+    size_t offset_align; // file offset and transfer length alignment
+    const char *source;  // where the values came from
+};
+
+#if defined(__linux__) && defined(SYS_statx)
+/*
+ * The kernel's struct statx. Older glibc headers stop before the DIO fields,
+ * so the layout is spelled out here; it is part of the syscall ABI.
+ */
+struct dio_statx {
+    uint32_t mask;
+    uint32_t blksize;
+    uint64_t attributes;
+    uint32_t nlink, uid, gid;
+    uint16_t mode, pad0;
+    uint64_t ino, size, blocks, attributes_mask;
+    uint64_t timestamps[8]; // atime, btime, ctime, mtime
+    uint32_t rdev_major, rdev_minor, dev_major, dev_minor;
+    uint64_t mnt_id;
+    uint32_t dio_mem_align;
+    uint32_t dio_offset_align;
+    uint64_t spare[12];
+};
+_Static_assert(sizeof(struct dio_statx) == 256, "struct statx is 256 bytes");
+_Static_assert(offsetof(struct dio_statx, dio_mem_align) == 0x98, "statx DIO fields moved");
+
+#define DIO_STATX_DIOALIGN 0x00002000U
+#endif
+
+static inline void dio_align_discover(int fd, struct dio_align *a)
+{
+    a->mem_align = a->offset_align = DIO_DEFAULT_ALIGN;
+    a->source = "default";
+
+#if defined(__linux__) && defined(SYS_statx)
+    struct dio_statx stx;
+    memset(&stx, 0, sizeof(stx));
+    if (syscall(SYS_statx, fd, "", AT_EMPTY_PATH, DIO_STATX_DIOALIGN, &stx) == 0 &&
+        (stx.mask & DIO_STATX_DIOALIGN) && stx.dio_offset_align != 0) {
+        a->mem_align = stx.dio_mem_align;
+        a->offset_align = stx.dio_offset_align;
+        a->source = "statx";
+        return;
+    }
+#endif
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+#if defined(__linux__) && defined(BLKSSZGET)
+        int bfd = -1;
+        if (S_ISBLK(st.st_mode)) {
+            bfd = fd;
+        } else {
+            char dev[64];
+            snprintf(dev, sizeof(dev), "/dev/block/%u:%u", major(st.st_dev), minor(st.st_dev));
+            bfd = open(dev, O_RDONLY | O_CLOEXEC);
+        }
+        int lbs = 0;
+        if (bfd >= 0 && ioctl(bfd, BLKSSZGET, &lbs) == 0 && lbs > 0) {
+            a->mem_align = a->offset_align = (size_t)lbs;
+            a->source = "BLKSSZGET";
+        }
+        if (bfd >= 0 && bfd != fd) close(bfd);
+        if (lbs > 0) return;
+#endif
+    }
+
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) == 0 && sfs.f_bsize > 0) {
+        a->mem_align = a->offset_align = (size_t)sfs.f_bsize;
+        a->source = "fstatfs";
+    }
+}
+
+/* discover for a path that may not exist yet: its directory stands in for it */
+static inline void dio_align_discover_path(const char *path, struct dio_align *a)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        char dir[4096];
+        const char *slash = strrchr(path, '/');
+        if (slash && slash != path) snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+        else snprintf(dir, sizeof(dir), "%s", slash ? "/" : ".");
+        fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        a->mem_align = a->offset_align = DIO_DEFAULT_ALIGN;
+        a->source = "default";
+        return;
+    }
+    dio_align_discover(fd, a);
+    close(fd);
+}
+
+static inline int dio_aligned(const struct dio_align *a, const void *buf, size_t len, off_t off)
+{
+    return (uintptr_t)buf % a->mem_align == 0 && len % a->offset_align == 0 &&
+           (uint64_t)off % a->offset_align == 0;
+}
+
+/*
+ * The aligned prefix goes out with O_DIRECT; whatever is left (a tail that is
+ * not a whole number of blocks, or everything if buf/off are misaligned) goes
+ * through the page cache by clearing O_DIRECT for that one call. The flag
+ * lives on the open file description, so this must not race with other I/O
+ * on the same fd.
+ */
+static inline ssize_t dio_transfer(int fd, void *buf, size_t len, off_t off, const struct dio_align *a,
+                                   int is_write)
+{
+    if (dio_aligned(a, buf, len, off)) {
+        return is_write ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+    }
+
+    size_t head = 0;
+    if ((uintptr_t)buf % a->mem_align == 0 && (uint64_t)off % a->offset_align == 0) {
+        head = len / a->offset_align * a->offset_align;
+    }
+    if (head > 0) {
+        ssize_t n = is_write ? pwrite(fd, buf, head, off) : pread(fd, buf, head, off);
+        if (n < (ssize_t)head) return n; // error, EOF or a short transfer: let the caller retry
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) return head ? (ssize_t)head : -1;
+    if ((flags & O_DIRECT) && fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0) return head ? (ssize_t)head : -1;
+    unsigned char *tail = (unsigned char *)buf + head;
+    ssize_t t = is_write ? pwrite(fd, tail, len - head, off + (off_t)head)
+                         : pread(fd, tail, len - head, off + (off_t)head);
+    int saved = errno;
+    if (flags & O_DIRECT) fcntl(fd, F_SETFL, flags);
+    errno = saved;
+
+    if (t < 0) return head ? (ssize_t)head : -1;
+    return (ssize_t)head + t;
+}
+
+static inline ssize_t dio_pwrite(int fd, const void *buf, size_t len, off_t off, const struct dio_align *a)
+{
+    return dio_transfer(fd, (void *)buf, len, off, a, 1);
+}
+
+static inline ssize_t dio_pread(int fd, void *buf, size_t len, off_t off, const struct dio_align *a)
+{
+    return dio_transfer(fd, buf, len, off, a, 0);
+}
+
+/*
+ * Fixed-size buffers carved from one allocation and touched up front, so no
+ * benchmark allocates or page-faults inside a timed loop. Not thread-safe:
+ * take what each thread needs before starting them.
+ */
+struct buf_pool {
+    unsigned char *mem;
+    size_t map_len;   // non-zero when mem came from mmap
+    size_t buf_size;  // usable bytes per buffer
+    size_t stride;    // buf_size rounded up to the alignment
+    unsigned count;
+    unsigned nfree;
+    unsigned *free_idx;
+};
+
+static inline int buf_pool_init(struct buf_pool *p, unsigned count, size_t buf_size, size_t align)
+{
+    memset(p, 0, sizeof(*p));
+    long page = sysconf(_SC_PAGESIZE);
+    if (align == 0) align = DIO_DEFAULT_ALIGN;
+    p->buf_size = buf_size;
+    p->stride = (buf_size + align - 1) / align * align;
+    p->count = count;
+    size_t total = p->stride * count;
+
+    if (page > 0 && align <= (size_t)page) {
+        // anonymous mappings are page aligned, which covers every smaller alignment
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;
+#endif
+        void *m = mmap(NULL, total ? total : 1, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (m == MAP_FAILED) return -1;
+        p->mem = m;
+        p->map_len = total ? total : 1;
+    } else {
+        void *m = NULL;
+        if (posix_memalign(&m, align, total ? total : 1) != 0) return -1;
+        p->mem = m;
+    }
+    memset(p->mem, 0, total); // fault every page in now rather than in a timed loop
+
+    p->free_idx = malloc((count ? count : 1) * sizeof(*p->free_idx));
+    if (!p->free_idx) return -1;
+    for (unsigned i = 0; i < count; i++) p->free_idx[i] = count - 1 - i;
+    p->nfree = count;
+    return 0;
+}
+
+/* NULL once every buffer is handed out */
+static inline void *buf_pool_get(struct buf_pool *p)
+{
+    if (p->nfree == 0) return NULL;
+    return p->mem + (size_t)p->free_idx[--p->nfree] * p->stride;
+}
+
+static inline void buf_pool_put(struct buf_pool *p, void *buf)
+{
+    if (!buf) return;
+    p->free_idx[p->nfree++] = (unsigned)(((unsigned char *)buf - p->mem) / p->stride);
+}
+
+static inline void buf_pool_destroy(struct buf_pool *p)
+{
+    if (p->map_len) munmap(p->mem, p->map_len);
+    else free(p->mem);
+    free(p->free_idx);
+    memset(p, 0, sizeof(*p));
+}
+
+#endif
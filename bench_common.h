@@ -0,0 +1,90 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+/*
+ * Helpers shared by the I/O benchmarks: monotonic timing, size parsing
+ * and a small seedable RNG so every program generates the same offsets
+ * from the same seed.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+
+static inline long long timespec_to_ns(const struct timespec *t)
+{
+    return (long long)t->tv_sec * 1000000000LL + t->tv_nsec;
+}
+
+//calculate time difference in ns
+static inline long long elapsed_ns(struct timespec start, struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+}
+
+static inline long long now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return timespec_to_ns(&t);
+}
+
+/* parse "4096", "4K", "16M", "2G" (binary multiples); returns -1 on junk */
+static inline int parse_size(const char *s, uint64_t *out)
+{
+    char *end = NULL;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s) return -1;
+
+    switch (toupper((unsigned char)*end)) {
+    case 'G': v <<= 10; /* fall through */
+    case 'M': v <<= 10; /* fall through */
+    case 'K': v <<= 10; end++; break;
+    case '\0': break;
+    default: return -1;
+    }
+    if (*end == 'B' || *end == 'b') end++;
+    if (*end != '\0') return -1;
+
+    *out = v;
+    return 0;
+}
+
+/* xorshift64*, seeded through splitmix64 so small seeds still spread well */
+struct bench_rng {
+    uint64_t s;
+};
+
+static inline void rng_seed(struct bench_rng *r, uint64_t seed)
+{
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    r->s = z ? z : 1;
+}
+
+static inline uint64_t rng_next(struct bench_rng *r)
+{
+    uint64_t x = r->s;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    r->s = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* uniform in [0, n) */
+static inline uint64_t rng_below(struct bench_rng *r, uint64_t n)
+{
+    return n ? rng_next(r) % n : 0;
+}
+
+/* uniform in [0, 1) */
+static inline double rng_double(struct bench_rng *r)
+{
+    return (double)(rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#endif
@@ -0,0 +1,742 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+/*
+ * One driver for every I/O path in this repo: the same workload spec is run
+ * against each engine (sync pread/pwrite, POSIX AIO, io_uring, mmap) and the
+ * results come out in one format so they can be compared line by line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <aio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <liburing.h>
+
+#include "bench_common.h"
+#include "lat_hist.h"
+#include "workload.h"
+#include "aligned_pool.h"
+#include "io_stats.h"
+
+enum sync_policy {
+    SYNC_NONE,
+    SYNC_FSYNC,
+    SYNC_FDATASYNC
+};
+
+enum out_format {
+    OUT_TEXT,
+    OUT_CSV,
+    OUT_JSON
+};
+
+struct workload {
+    const char *path;
+    uint64_t block_size;
+    uint64_t total_bytes;
+    unsigned qd;
+    unsigned read_pct;          // 0..100, share of ops that are reads
+    enum access_pattern pattern;
+    double zipf_theta;
+    bool direct;                // O_DIRECT
+    enum sync_policy sync;
+    unsigned sync_every;        // sync after every K writes
+    uint64_t seed;
+};
+
+struct bench_result {
+    const char *engine;
+    uint64_t ops, reads, writes, bytes, syncs;
+    long long elapsed_ns;
+    struct lat_hist lat;
+};
+
+/* the shared op stream plus this driver's sync cadence */
+struct op_stream {
+    const struct workload *w;
+    struct op_gen gen;
+    unsigned writes_since_sync;
+};
+
+struct engine {
+    const char *name;
+    bool supports_direct;
+    int (*run)(const struct workload *w, int fd, struct bench_result *r);
+};
+
+static const char *sync_policy_name(enum sync_policy s)
+{
+    switch (s) {
+    case SYNC_FSYNC:     return "fsync";
+    case SYNC_FDATASYNC: return "fdatasync";
+    default:             return "none";
+    }
+}
+
+static void stream_init(struct op_stream *st, const struct workload *w)
+{
+    uint64_t nblocks = w->total_bytes / w->block_size;
+    st->w = w;
+    st->writes_since_sync = 0;
+    op_gen_init(&st->gen, w->pattern, w->read_pct, w->block_size, nblocks, nblocks,
+                w->zipf_theta, w->seed);
+}
+
+/* call after each write is issued; true when a sync is due */
+static bool stream_sync_due(struct op_stream *st)
+{
+    if (st->w->sync == SYNC_NONE) return false;
+    if (++st->writes_since_sync < st->w->sync_every) return false;
+    st->writes_since_sync = 0;
+    return true;
+}
+
+static void result_record(struct bench_result *r, const struct workload *w, bool is_read, long long ns)
+{
+    r->ops++;
+    if (is_read) r->reads++;
+    else r->writes++;
+    r->bytes += w->block_size;
+    lat_hist_record(&r->lat, ns);
+    stats_op(w->block_size);
+}
+
+static int do_sync(const struct workload *w, int fd)
+{
+    stats_fsync();
+    return w->sync == SYNC_FDATASYNC ? fdatasync(fd) : fsync(fd);
+}
+
+/* qd block buffers aligned for O_DIRECT on the target file, filled once in main */
+static struct buf_pool io_bufs;
+
+static void *take_buffer(void)
+{
+    void *p = buf_pool_get(&io_bufs);
+    if (!p) fprintf(stderr, "buffer pool exhausted\n");
+    return p;
+}
+
+/* ---- sync pread/pwrite ---- */
+
+static int engine_psync(const struct workload *w, int fd, struct bench_result *r)
+{
+    void *buf = take_buffer();
+    if (!buf) return -1;
+
+    struct op_stream st;
+    struct io_op op;
+    stream_init(&st, w);
+
+    while (op_next(&st.gen, &op)) {
+        long long t0 = now_ns();
+        ssize_t n = op.is_read ? pread(fd, buf, w->block_size, op.offset)
+                               : pwrite(fd, buf, w->block_size, op.offset);
+        if (n != (ssize_t)w->block_size) {
+            fprintf(stderr, "psync: %s returned %zd: %s\n", op.is_read ? "pread" : "pwrite",
+                    n, n < 0 ? strerror(errno) : "short");
+            buf_pool_put(&io_bufs, buf);
+            return -1;
+        }
+        result_record(r, w, op.is_read, now_ns() - t0);
+        stats_syscalls(1);
+
+        if (!op.is_read && stream_sync_due(&st)) {
+            if (do_sync(w, fd) < 0) {
+                perror("sync");
+                buf_pool_put(&io_bufs, buf);
+                return -1;
+            }
+            r->syncs++;
+        }
+    }
+    buf_pool_put(&io_bufs, buf);
+    return 0;
+}
+
+/* ---- POSIX AIO, QD requests in flight ---- */
+
+static int aio_drain(struct aiocb *cbs, const struct aiocb **list, unsigned qd,
+                     long long *start, bool *is_read, unsigned *inflight,
+                     const struct workload *w, struct bench_result *r, bool all)
+{
+    unsigned before = *inflight;
+    while (*inflight > 0) {
+        if (aio_suspend(list, (int)qd, NULL) < 0 && errno != EINTR) {
+            perror("aio_suspend");
+            return -1;
+        }
+        for (unsigned s = 0; s < qd; s++) {
+            if (!list[s]) continue;
+            int err = aio_error(&cbs[s]);
+            if (err == EINPROGRESS) continue;
+            ssize_t n = aio_return(&cbs[s]);
+            if (err != 0 || n != (ssize_t)w->block_size) {
+                fprintf(stderr, "aio: op failed: %s\n", err ? strerror(err) : "short transfer");
+                return -1;
+            }
+            result_record(r, w, is_read[s], now_ns() - start[s]);
+            list[s] = NULL;
+            (*inflight)--;
+        }
+        if (!all && *inflight < before) break;
+    }
+    return 0;
+}
+
+static int engine_aio(const struct workload *w, int fd, struct bench_result *r)
+{
+    unsigned qd = w->qd;
+    struct aiocb *cbs = calloc(qd, sizeof(*cbs));
+    const struct aiocb **list = calloc(qd, sizeof(*list));
+    long long *start = calloc(qd, sizeof(*start));
+    bool *is_read = calloc(qd, sizeof(*is_read));
+    void **bufs = calloc(qd, sizeof(*bufs));
+    int rc = -1;
+
+    if (!cbs || !list || !start || !is_read || !bufs) {
+        perror("calloc");
+        goto out;
+    }
+    for (unsigned s = 0; s < qd; s++) {
+        if (!(bufs[s] = take_buffer())) goto out;
+    }
+
+    struct op_stream st;
+    struct io_op op;
+    unsigned inflight = 0;
+    stream_init(&st, w);
+
+    while (op_next(&st.gen, &op)) {
+        if (inflight == qd && aio_drain(cbs, list, qd, start, is_read, &inflight, w, r, false) < 0) {
+            goto out;
+        }
+
+        unsigned s = 0;
+        while (list[s]) s++;
+
+        memset(&cbs[s], 0, sizeof(cbs[s]));
+        cbs[s].aio_fildes = fd;
+        cbs[s].aio_buf = bufs[s];
+        cbs[s].aio_nbytes = w->block_size;
+        cbs[s].aio_offset = op.offset;
+        is_read[s] = op.is_read;
+        start[s] = now_ns();
+
+        if ((op.is_read ? aio_read(&cbs[s]) : aio_write(&cbs[s])) < 0) {
+            perror(op.is_read ? "aio_read" : "aio_write");
+            goto out;
+        }
+        stats_submit();
+        list[s] = &cbs[s];
+        inflight++;
+
+        if (!op.is_read && stream_sync_due(&st)) {
+            // aio_fsync only covers requests already completed, so drain first
+            if (aio_drain(cbs, list, qd, start, is_read, &inflight, w, r, true) < 0) goto out;
+
+            struct aiocb scb;
+            memset(&scb, 0, sizeof(scb));
+            scb.aio_fildes = fd;
+            if (aio_fsync(w->sync == SYNC_FDATASYNC ? O_DSYNC : O_SYNC, &scb) < 0) {
+                perror("aio_fsync");
+                goto out;
+            }
+            stats_submit();
+            stats_fsync_queued();
+            const struct aiocb *sl[1] = {&scb};
+            int err;
+            while ((err = aio_error(&scb)) == EINPROGRESS) {
+                aio_suspend(sl, 1, NULL);
+            }
+            // aio_return releases the control block, so the error has to be read first
+            if (aio_return(&scb) < 0) {
+                fprintf(stderr, "aio_fsync: %s\n", strerror(err));
+                goto out;
+            }
+            r->syncs++;
+        }
+    }
+    if (aio_drain(cbs, list, qd, start, is_read, &inflight, w, r, true) < 0) goto out;
+    rc = 0;
+
+out:
+    if (bufs) {
+        for (unsigned s = 0; s < qd; s++) buf_pool_put(&io_bufs, bufs[s]);
+    }
+    free(bufs);
+    free(is_read);
+    free(start);
+    free(list);
+    free(cbs);
+    return rc;
+}
+
+/* ---- io_uring, QD requests in flight, syncs as drain barriers ---- */
+
+#define URING_SYNC_TAG UINT64_MAX
+
+static int engine_uring(const struct workload *w, int fd, struct bench_result *r)
+{
+    unsigned qd = w->qd;
+    unsigned entries = 1;
+    while (entries < 2 * qd) entries <<= 1; // room for a sync behind every write
+
+    struct io_uring ring;
+    int ret = io_uring_queue_init(entries, &ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    long long *start = calloc(qd, sizeof(*start));
+    bool *is_read = calloc(qd, sizeof(*is_read));
+    unsigned *free_slots = calloc(qd, sizeof(*free_slots));
+    void **bufs = calloc(qd, sizeof(*bufs));
+    int rc = -1;
+
+    if (!start || !is_read || !free_slots || !bufs) {
+        perror("calloc");
+        goto out;
+    }
+    for (unsigned s = 0; s < qd; s++) {
+        if (!(bufs[s] = take_buffer())) goto out;
+        free_slots[s] = s;
+    }
+
+    struct op_stream st;
+    struct io_op op;
+    unsigned nfree = qd;
+    unsigned inflight = 0;
+    bool more = true;
+    stream_init(&st, w);
+
+    while (more || inflight > 0) {
+        while (more && nfree > 0) {
+            if (!op_next(&st.gen, &op)) {
+                more = false;
+                break;
+            }
+            unsigned s = free_slots[--nfree];
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+            if (!sqe) {
+                fprintf(stderr, "io_uring_get_sqe: ring full\n");
+                goto out;
+            }
+            if (op.is_read) io_uring_prep_read(sqe, fd, bufs[s], (unsigned)w->block_size, op.offset);
+            else io_uring_prep_write(sqe, fd, bufs[s], (unsigned)w->block_size, op.offset);
+            io_uring_sqe_set_data64(sqe, s);
+            is_read[s] = op.is_read;
+            start[s] = now_ns();
+            inflight++;
+
+            if (!op.is_read && stream_sync_due(&st)) {
+                // IOSQE_IO_DRAIN waits for everything before it and holds everything after
+                struct io_uring_sqe *ssqe = io_uring_get_sqe(&ring);
+                if (!ssqe) {
+                    fprintf(stderr, "io_uring_get_sqe: ring full\n");
+                    goto out;
+                }
+                io_uring_prep_fsync(ssqe, fd, w->sync == SYNC_FDATASYNC ? IORING_FSYNC_DATASYNC : 0);
+                io_uring_sqe_set_flags(ssqe, IOSQE_IO_DRAIN);
+                io_uring_sqe_set_data64(ssqe, URING_SYNC_TAG);
+                inflight++;
+            }
+        }
+
+        if (inflight == 0) break;
+
+        ret = io_uring_submit_and_wait(&ring, 1);
+        if (ret < 0) {
+            fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+            goto out;
+        }
+        stats_submit();
+
+        struct io_uring_cqe *cqe;
+        while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+            uint64_t tag = io_uring_cqe_get_data64(cqe);
+            if (tag == URING_SYNC_TAG) {
+                if (cqe->res < 0) {
+                    fprintf(stderr, "io_uring fsync: %s\n", strerror(-cqe->res));
+                    goto out;
+                }
+                stats_fsync_queued();
+                r->syncs++;
+            } else {
+                if (cqe->res != (int)w->block_size) {
+                    fprintf(stderr, "io_uring: op returned %d\n", cqe->res);
+                    goto out;
+                }
+                result_record(r, w, is_read[tag], now_ns() - start[tag]);
+                free_slots[nfree++] = (unsigned)tag;
+            }
+            inflight--;
+            io_uring_cqe_seen(&ring, cqe);
+        }
+    }
+    rc = 0;
+
+out:
+    if (bufs) {
+        for (unsigned s = 0; s < qd; s++) buf_pool_put(&io_bufs, bufs[s]);
+    }
+    free(bufs);
+    free(free_slots);
+    free(is_read);
+    free(start);
+    io_uring_queue_exit(&ring);
+    return rc;
+}
+
+/* ---- mmap + memcpy, msync as the sync ---- */
+
+static int engine_mmap(const struct workload *w, int fd, struct bench_result *r)
+{
+    if (ftruncate(fd, (off_t)w->total_bytes) < 0) {
+        perror("ftruncate");
+        return -1;
+    }
+    unsigned char *map = mmap(NULL, w->total_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    void *buf = take_buffer();
+    if (!buf) {
+        munmap(map, w->total_bytes);
+        return -1;
+    }
+
+    struct op_stream st;
+    struct io_op op;
+    int rc = 0;
+    stream_init(&st, w);
+
+    while (op_next(&st.gen, &op)) {
+        long long t0 = now_ns();
+        if (op.is_read) memcpy(buf, map + op.offset, w->block_size);
+        else memcpy(map + op.offset, buf, w->block_size);
+        result_record(r, w, op.is_read, now_ns() - t0);
+
+        if (!op.is_read && stream_sync_due(&st)) {
+            stats_fsync();
+            if (msync(map, w->total_bytes, MS_SYNC) < 0) {
+                perror("msync");
+                rc = -1;
+                break;
+            }
+            r->syncs++;
+        }
+    }
+    buf_pool_put(&io_bufs, buf);
+    munmap(map, w->total_bytes);
+    return rc;
+}
+
+static const struct engine engines[] = {
+    {"psync", true,  engine_psync},
+    {"aio",   true,  engine_aio},
+    {"uring", true,  engine_uring},
+    {"mmap",  false, engine_mmap},
+};
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+static void print_result(const struct workload *w, const struct bench_result *r,
+                         enum out_format fmt, bool header)
+{
+    double secs = r->elapsed_ns / 1e9;
+    double mbps = secs > 0 ? (double)r->bytes / (1024.0 * 1024.0) / secs : 0;
+    double iops = secs > 0 ? (double)r->ops / secs : 0;
+    const struct lat_hist *h = &r->lat;
+
+    switch (fmt) {
+    case OUT_CSV:
+        if (header) {
+            printf("engine,block_size,total_bytes,qd,read_pct,pattern,direct,sync,sync_every,"
+                   "ops,reads,writes,syncs,elapsed_ns,mb_per_s,iops,lat_min_ns,lat_avg_ns,"
+                   "lat_p50_ns,lat_p90_ns,lat_p99_ns,lat_p999_ns,lat_p9999_ns,lat_max_ns\n");
+        }
+        printf("%s,%llu,%llu,%u,%u,%s,%d,%s,%u,%llu,%llu,%llu,%llu,%lld,%.2f,%.0f,"
+               "%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld\n",
+               r->engine, (unsigned long long)w->block_size, (unsigned long long)w->total_bytes,
+               w->qd, w->read_pct, pattern_name(w->pattern), w->direct, sync_policy_name(w->sync),
+               w->sync_every, (unsigned long long)r->ops, (unsigned long long)r->reads,
+               (unsigned long long)r->writes, (unsigned long long)r->syncs, r->elapsed_ns,
+               mbps, iops, lat_hist_min(h), lat_hist_mean(h),
+               lat_hist_percentile(h, 50.0), lat_hist_percentile(h, 90.0),
+               lat_hist_percentile(h, 99.0), lat_hist_percentile(h, 99.9),
+               lat_hist_percentile(h, 99.99), h->max_ns);
+        break;
+    case OUT_JSON:
+        printf("{\"engine\":\"%s\",\"block_size\":%llu,\"total_bytes\":%llu,\"qd\":%u,\"read_pct\":%u,"
+               "\"pattern\":\"%s\",\"direct\":%s,\"sync\":\"%s\",\"sync_every\":%u,"
+               "\"ops\":%llu,\"reads\":%llu,\"writes\":%llu,\"syncs\":%llu,\"elapsed_ns\":%lld,"
+               "\"mb_per_s\":%.2f,\"iops\":%.0f,\"lat_min_ns\":%lld,\"lat_avg_ns\":%lld,"
+               "\"lat_p50_ns\":%lld,\"lat_p90_ns\":%lld,\"lat_p99_ns\":%lld,\"lat_p999_ns\":%lld,"
+               "\"lat_p9999_ns\":%lld,\"lat_max_ns\":%lld}\n",
+               r->engine, (unsigned long long)w->block_size, (unsigned long long)w->total_bytes,
+               w->qd, w->read_pct, pattern_name(w->pattern), w->direct ? "true" : "false",
+               sync_policy_name(w->sync), w->sync_every, (unsigned long long)r->ops,
+               (unsigned long long)r->reads, (unsigned long long)r->writes,
+               (unsigned long long)r->syncs, r->elapsed_ns, mbps, iops, lat_hist_min(h), lat_hist_mean(h),
+               lat_hist_percentile(h, 50.0), lat_hist_percentile(h, 90.0),
+               lat_hist_percentile(h, 99.0), lat_hist_percentile(h, 99.9),
+               lat_hist_percentile(h, 99.99), h->max_ns);
+        break;
+    default:
+        printf("%-6s ops: %llu (r %llu / w %llu), syncs: %llu, %.2f MB/s, %.0f IOPS\n",
+               r->engine, (unsigned long long)r->ops, (unsigned long long)r->reads,
+               (unsigned long long)r->writes, (unsigned long long)r->syncs, mbps, iops);
+        lat_hist_print(stdout, "       latency", h);
+        break;
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options] [file]\n"
+        "  -e, --engine LIST     comma separated: psync,aio,uring,mmap or all (default all)\n"
+        "  -b, --block-size N    bytes per op, K/M/G suffixes allowed (default 4K)\n"
+        "  -s, --size N          total bytes per run (default 64M)\n"
+        "  -q, --qd N            ops in flight for aio/uring (default 1)\n"
+        "  -r, --read-pct N      percent of ops that are reads (default 0)\n"
+        "  -p, --pattern P       seq, uniform (rand) or zipf (default seq)\n"
+        "  -z, --zipf-theta T    skew for the zipf pattern, 0 < T < 1 (default 0.99)\n"
+        "  -d, --direct          open with O_DIRECT\n"
+        "  -y, --sync P          none, fsync or fdatasync (default none)\n"
+        "  -k, --sync-every K    sync after every K writes (default 1)\n"
+        "  -S, --seed N          RNG seed for rand/mixed workloads (default 1)\n"
+        "  -f, --format F        text, csv or json (default text)\n"
+        "      --hist-out FILE   dump every engine's full latency distribution as CSV\n",
+        prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct workload w = {
+        .path = "io_bench.bin",
+        .block_size = 4096,
+        .total_bytes = 64ULL << 20,
+        .qd = 1,
+        .read_pct = 0,
+        .pattern = PATTERN_SEQ,
+        .zipf_theta = ZIPF_DEFAULT_THETA,
+        .direct = false,
+        .sync = SYNC_NONE,
+        .sync_every = 1,
+        .seed = 1,
+    };
+    enum out_format fmt = OUT_TEXT;
+    const char *hist_out = NULL;
+    bool selected[NUM_ENGINES];
+    for (size_t i = 0; i < NUM_ENGINES; i++) selected[i] = true;
+
+    static const struct option long_opts[] = {
+        {"engine",     required_argument, NULL, 'e'},
+        {"block-size", required_argument, NULL, 'b'},
+        {"size",       required_argument, NULL, 's'},
+        {"qd",         required_argument, NULL, 'q'},
+        {"read-pct",   required_argument, NULL, 'r'},
+        {"pattern",    required_argument, NULL, 'p'},
+        {"zipf-theta", required_argument, NULL, 'z'},
+        {"direct",     no_argument,       NULL, 'd'},
+        {"sync",       required_argument, NULL, 'y'},
+        {"sync-every", required_argument, NULL, 'k'},
+        {"seed",       required_argument, NULL, 'S'},
+        {"format",     required_argument, NULL, 'f'},
+        {"hist-out",   required_argument, NULL, 'H'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "e:b:s:q:r:p:z:dy:k:S:f:H:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'e':
+            if (strcmp(optarg, "all") == 0) break;
+            for (size_t i = 0; i < NUM_ENGINES; i++) selected[i] = false;
+            for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+                size_t i = 0;
+                while (i < NUM_ENGINES && strcmp(engines[i].name, tok) != 0) i++;
+                if (i == NUM_ENGINES) {
+                    fprintf(stderr, "unknown engine: %s\n", tok);
+                    return 1;
+                }
+                selected[i] = true;
+            }
+            break;
+        case 'b':
+            if (parse_size(optarg, &w.block_size) < 0 || w.block_size == 0) {
+                fprintf(stderr, "bad block size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            if (parse_size(optarg, &w.total_bytes) < 0) {
+                fprintf(stderr, "bad size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'q':
+            w.qd = (unsigned)strtoul(optarg, NULL, 10);
+            if (w.qd == 0) w.qd = 1;
+            break;
+        case 'r':
+            w.read_pct = (unsigned)strtoul(optarg, NULL, 10);
+            if (w.read_pct > 100) w.read_pct = 100;
+            break;
+        case 'p':
+            if (parse_pattern(optarg, &w.pattern) < 0) {
+                fprintf(stderr, "unknown pattern: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'z':
+            w.zipf_theta = strtod(optarg, NULL);
+            if (!zipf_theta_valid(w.zipf_theta)) {
+                fprintf(stderr, "zipf theta must be between 0 and 1 (exclusive)\n");
+                return 1;
+            }
+            break;
+        case 'd':
+            w.direct = true;
+            break;
+        case 'y':
+            if (strcmp(optarg, "none") == 0) w.sync = SYNC_NONE;
+            else if (strcmp(optarg, "fsync") == 0) w.sync = SYNC_FSYNC;
+            else if (strcmp(optarg, "fdatasync") == 0) w.sync = SYNC_FDATASYNC;
+            else {
+                fprintf(stderr, "unknown sync policy: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            w.sync_every = (unsigned)strtoul(optarg, NULL, 10);
+            if (w.sync_every == 0) w.sync_every = 1;
+            break;
+        case 'S':
+            w.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            if (strcmp(optarg, "text") == 0) fmt = OUT_TEXT;
+            else if (strcmp(optarg, "csv") == 0) fmt = OUT_CSV;
+            else if (strcmp(optarg, "json") == 0) fmt = OUT_JSON;
+            else {
+                fprintf(stderr, "unknown format: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'H':
+            hist_out = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc) {
+        w.path = argv[optind];
+    }
+
+    if (w.total_bytes / w.block_size == 0) {
+        fprintf(stderr, "size %llu is smaller than one block of %llu\n",
+                (unsigned long long)w.total_bytes, (unsigned long long)w.block_size);
+        return 1;
+    }
+    w.total_bytes -= w.total_bytes % w.block_size;
+    stats_init(argv[0], "setup");
+
+    struct dio_align dio;
+    dio_align_discover_path(w.path, &dio);
+    if (w.direct && w.block_size % dio.offset_align != 0) {
+        fprintf(stderr, "O_DIRECT on %s needs a block size that is a multiple of %zu (from %s)\n",
+                w.path, dio.offset_align, dio.source);
+        return 1;
+    }
+    if (buf_pool_init(&io_bufs, w.qd, w.block_size, dio.mem_align) < 0) {
+        perror("buffer pool");
+        return 1;
+    }
+    for (unsigned i = 0; i < w.qd; i++) {
+        unsigned char *p = io_bufs.mem + (size_t)i * io_bufs.stride;
+        for (size_t j = 0; j < w.block_size; j++) p[j] = (unsigned char)(j & 0xFF);
+    }
+
+    if (w.read_pct > 0 && prefill_file(w.path, w.total_bytes) < 0) {
+        return 1;
+    }
+
+    if (fmt == OUT_TEXT) {
+        printf("io_bench: %s, bs %llu, size %llu, qd %u, %u%% reads, %s, %s, sync %s every %u\n",
+               w.path, (unsigned long long)w.block_size, (unsigned long long)w.total_bytes, w.qd,
+               w.read_pct, pattern_name(w.pattern), w.direct ? "direct" : "buffered",
+               sync_policy_name(w.sync), w.sync_every);
+    }
+
+    FILE *hf = NULL;
+    if (hist_out) {
+        if (!(hf = fopen(hist_out, "w"))) {
+            perror("open hist-out");
+            return 1;
+        }
+        fprintf(hf, "series,value_ns,count,cumulative\n");
+    }
+
+    static struct bench_result r;
+    bool header = true;
+    int status = 0;
+    for (size_t i = 0; i < NUM_ENGINES; i++) {
+        if (!selected[i]) continue;
+        const struct engine *e = &engines[i];
+        if (w.direct && !e->supports_direct) {
+            fprintf(stderr, "%s: skipped, engine has no O_DIRECT mode\n", e->name);
+            continue;
+        }
+
+        // write-only runs start from an empty file so every engine sees the same state
+        int flags = O_CREAT | O_RDWR | (w.read_pct == 0 ? O_TRUNC : 0) | (w.direct ? O_DIRECT : 0);
+        int fd = open(w.path, flags, 0644);
+        if (fd < 0) {
+            perror("open");
+            return 1;
+        }
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+        stats_phase(e->name);
+        memset(&r, 0, sizeof(r));
+        r.engine = e->name;
+        lat_hist_init(&r.lat);
+        long long t0 = now_ns();
+        int rc = e->run(&w, fd, &r);
+        if (rc == 0 && w.sync != SYNC_NONE && r.writes % w.sync_every != 0 && do_sync(&w, fd) == 0) {
+            r.syncs++; // trailing sync so a partial sync group is durable too
+        }
+        r.elapsed_ns = now_ns() - t0;
+        close(fd);
+
+        if (rc < 0) {
+            fprintf(stderr, "%s: run failed\n", e->name);
+            status = 1;
+            continue;
+        }
+        print_result(&w, &r, fmt, header);
+        header = false;
+        if (hf) lat_hist_dump(hf, e->name, &r.lat);
+    }
+    if (hf) fclose(hf);
+    return status;
+}
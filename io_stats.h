@@ -0,0 +1,311 @@
+#ifndef IO_STATS_H
+#define IO_STATS_H
+
+/*
+ * Per-phase counters shared by the programs, so a run can say why one path
+ * is faster and not only that it is: how many ops, bytes, syscalls, fsyncs and
+ * queue submissions each phase needed, what getrusage saw change over it
+ * (CPU time, faults, context switches, block I/O), and optionally the cycles
+ * and instructions perf_event_open counted.
+ *
+ * Nothing is printed unless IO_STATS is set in the environment:
+ *   IO_STATS=1     one JSON line on stderr at exit
+ *   IO_STATS=perf  the same, plus cycles/instructions where perf allows it
+ * IO_STATS_OUT=FILE appends the line to FILE instead.
+ *
+ * Counting is a relaxed atomic add on the current phase, so worker threads
+ * may count too. Phases themselves are begun and ended from one thread.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#include "bench_common.h"
+
+#define STATS_MAX_PHASES 64 // the last slot is the "other" bucket for names past the rest
+
+#define STATS_NAME_MAX 48
+
+struct stats_phase {
+    char name[STATS_NAME_MAX];
+    uint64_t ops;        // logical I/O operations (reads, writes, copies)
+    uint64_t bytes;      // payload bytes those ops moved
+    uint64_t syscalls;   // I/O syscalls issued, including fsyncs and submits
+    uint64_t fsyncs;     // fsync, fdatasync, sync_file_range, msync
+    uint64_t submits;    // io_uring_submit / aio_* submission calls
+    long long wall_ns;
+    struct rusage ru;    // deltas once the phase has ended
+    uint64_t cycles;
+    uint64_t instructions;
+
+    long long start_ns;
+    struct rusage ru_start;
+    uint64_t perf_start[2];
+};
+
+struct io_stats {
+    const char *prog;
+    int enabled;
+    int nphases;
+    struct stats_phase phases[STATS_MAX_PHASES];
+    struct stats_phase *cur;
+    int perf_fd[2];      // cycles, instructions; -1 when unavailable
+    long long start_ns;
+};
+
+static struct io_stats io_stats_g = {.perf_fd = {-1, -1}};
+
+static inline void stats_perf_open(void)
+{
+#ifdef __linux__
+    static const uint64_t configs[2] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS};
+    for (int i = 0; i < 2; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.inherit = 1; // threads created later are counted too
+        attr.exclude_kernel = 0;
+        attr.exclude_hv = 1;
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd < 0) {
+            // paranoid kernels still allow user-only counting
+            attr.exclude_kernel = 1;
+            fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        io_stats_g.perf_fd[i] = fd;
+    }
+#endif
+}
+
+static inline void stats_perf_read(uint64_t out[2])
+{
+    for (int i = 0; i < 2; i++) {
+        out[i] = 0;
+        if (io_stats_g.perf_fd[i] >= 0 && read(io_stats_g.perf_fd[i], &out[i], sizeof(out[i])) != sizeof(out[i]))
+            out[i] = 0;
+    }
+}
+
+static inline long tv_us(const struct timeval *t)
+{
+    return (long)t->tv_sec * 1000000L + (long)t->tv_usec;
+}
+
+static inline void stats_phase_end(void)
+{
+    struct stats_phase *p = io_stats_g.cur;
+    if (!p) return;
+    io_stats_g.cur = NULL;
+
+    struct rusage now;
+    getrusage(RUSAGE_SELF, &now);
+    uint64_t perf_now[2];
+    stats_perf_read(perf_now);
+
+    p->wall_ns += now_ns() - p->start_ns;
+    struct rusage *d = &p->ru, *s = &p->ru_start;
+    long ut = tv_us(&d->ru_utime) + tv_us(&now.ru_utime) - tv_us(&s->ru_utime);
+    long st = tv_us(&d->ru_stime) + tv_us(&now.ru_stime) - tv_us(&s->ru_stime);
+    d->ru_utime.tv_sec = ut / 1000000L;
+    d->ru_utime.tv_usec = ut % 1000000L;
+    d->ru_stime.tv_sec = st / 1000000L;
+    d->ru_stime.tv_usec = st % 1000000L;
+    d->ru_minflt += now.ru_minflt - s->ru_minflt;
+    d->ru_majflt += now.ru_majflt - s->ru_majflt;
+    d->ru_nvcsw += now.ru_nvcsw - s->ru_nvcsw;
+    d->ru_nivcsw += now.ru_nivcsw - s->ru_nivcsw;
+    d->ru_inblock += now.ru_inblock - s->ru_inblock;
+    d->ru_oublock += now.ru_oublock - s->ru_oublock;
+    p->cycles += perf_now[0] - p->perf_start[0];
+    p->instructions += perf_now[1] - p->perf_start[1];
+}
+
+/*
+ * Start counting into phase `name`, ending the current one. Re-entering a
+ * name resumes accumulating into it; once STATS_MAX_PHASES - 1 distinct names
+ * are in use, further ones are counted together under "other".
+ */
+static inline void stats_phase(const char *name)
+{
+    if (!io_stats_g.enabled) return;
+    stats_phase_end();
+
+    struct stats_phase *p = NULL;
+    for (int i = 0; i < io_stats_g.nphases; i++) {
+        if (strcmp(io_stats_g.phases[i].name, name) == 0) p = &io_stats_g.phases[i];
+    }
+    if (!p) {
+        if (io_stats_g.nphases < STATS_MAX_PHASES - 1) {
+            p = &io_stats_g.phases[io_stats_g.nphases++];
+            snprintf(p->name, sizeof(p->name), "%s", name);
+        } else {
+            p = &io_stats_g.phases[STATS_MAX_PHASES - 1];
+            if (io_stats_g.nphases < STATS_MAX_PHASES) {
+                io_stats_g.nphases = STATS_MAX_PHASES;
+                snprintf(p->name, sizeof(p->name), "other");
+            }
+        }
+    }
+
+    p->start_ns = now_ns();
+    getrusage(RUSAGE_SELF, &p->ru_start);
+    stats_perf_read(p->perf_start);
+    io_stats_g.cur = p;
+}
+
+/* one logical op; a no-op unless IO_STATS enabled counting */
+static inline void stats_op(uint64_t bytes)
+{
+    struct stats_phase *p = io_stats_g.cur;
+    if (!p) return;
+    __atomic_fetch_add(&p->ops, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* a batch of ops counted once, e.g. by a worker thread when it finishes */
+static inline void stats_ops(uint64_t ops, uint64_t bytes)
+{
+    struct stats_phase *p = io_stats_g.cur;
+    if (!p) return;
+    __atomic_fetch_add(&p->ops, ops, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+static inline void stats_syscalls(uint64_t n)
+{
+    struct stats_phase *p = io_stats_g.cur;
+    if (p) __atomic_fetch_add(&p->syscalls, n, __ATOMIC_RELAXED);
+}
+
+/* one read/write syscall that moved `bytes` */
+static inline void stats_rw(uint64_t bytes)
+{
+    stats_op(bytes);
+    stats_syscalls(1);
+}
+
+/* a synchronous fsync-class call */
+static inline void stats_fsync(void)
+{
+    struct stats_phase *p = io_stats_g.cur;
+    if (!p) return;
+    __atomic_fetch_add(&p->fsyncs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->syscalls, 1, __ATOMIC_RELAXED);
+}
+
+/* an fsync that rides in a queue (io_uring, aio) rather than its own syscall */
+static inline void stats_fsync_queued(void)
+{
+    struct stats_phase *p = io_stats_g.cur;
+    if (p) __atomic_fetch_add(&p->fsyncs, 1, __ATOMIC_RELAXED);
+}
+
+static inline void stats_submit(void)
+{
+    struct stats_phase *p = io_stats_g.cur;
+    if (!p) return;
+    __atomic_fetch_add(&p->submits, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->syscalls, 1, __ATOMIC_RELAXED);
+}
+
+/* s as a JSON string literal */
+static inline void stats_json_str(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static inline void stats_json_phase(FILE *f, const struct stats_phase *p, int perf)
+{
+    fputs("{\"name\":", f);
+    stats_json_str(f, p->name);
+    fprintf(f,
+            ",\"wall_ns\":%lld,\"ops\":%llu,\"bytes\":%llu,\"syscalls\":%llu,"
+            "\"fsyncs\":%llu,\"submits\":%llu,\"utime_us\":%ld,\"stime_us\":%ld,\"minflt\":%ld,"
+            "\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,\"inblock\":%ld,\"oublock\":%ld",
+            p->wall_ns, (unsigned long long)p->ops, (unsigned long long)p->bytes,
+            (unsigned long long)p->syscalls, (unsigned long long)p->fsyncs, (unsigned long long)p->submits,
+            tv_us(&p->ru.ru_utime), tv_us(&p->ru.ru_stime), p->ru.ru_minflt, p->ru.ru_majflt,
+            p->ru.ru_nvcsw, p->ru.ru_nivcsw, p->ru.ru_inblock, p->ru.ru_oublock);
+    if (perf) {
+        fprintf(f, ",\"cycles\":%llu,\"instructions\":%llu",
+                (unsigned long long)p->cycles, (unsigned long long)p->instructions);
+    }
+    fputc('}', f);
+}
+
+/* end the open phase and write the JSON line; safe to call more than once */
+static inline void stats_finish(void)
+{
+    if (!io_stats_g.enabled) return;
+    stats_phase_end();
+    io_stats_g.enabled = 0;
+
+    FILE *f = stderr;
+    const char *path = getenv("IO_STATS_OUT");
+    if (path && *path && !(f = fopen(path, "a"))) {
+        perror("IO_STATS_OUT");
+        f = stderr;
+    }
+
+    int perf = io_stats_g.perf_fd[0] >= 0 || io_stats_g.perf_fd[1] >= 0;
+    fputs("{\"prog\":", f);
+    stats_json_str(f, io_stats_g.prog);
+    fprintf(f, ",\"pid\":%d,\"wall_ns\":%lld,\"perf\":%s,\"phases\":[", (int)getpid(),
+            now_ns() - io_stats_g.start_ns, perf ? "true" : "false");
+    for (int i = 0; i < io_stats_g.nphases; i++) {
+        if (i) fputc(',', f);
+        stats_json_phase(f, &io_stats_g.phases[i], perf);
+    }
+    fputs("]}\n", f);
+    if (f != stderr) fclose(f);
+    else fflush(f);
+
+    for (int i = 0; i < 2; i++) {
+        if (io_stats_g.perf_fd[i] >= 0) close(io_stats_g.perf_fd[i]);
+        io_stats_g.perf_fd[i] = -1;
+    }
+}
+
+static inline void stats_atexit(void)
+{
+    stats_finish();
+}
+
+/*
+ * Call from main() once the arguments are parsed. Opens phase `first` so
+ * setup work is counted too, and registers the exit hook; paths that leave
+ * through _exit() call stats_finish() themselves.
+ */
+static inline void stats_init(const char *prog, const char *first)
+{
+    const char *env = getenv("IO_STATS");
+    if (!env || !*env || strcmp(env, "0") == 0) return;
+
+    const char *slash = strrchr(prog, '/');
+    io_stats_g.prog = slash ? slash + 1 : prog;
+    io_stats_g.enabled = 1;
+    io_stats_g.start_ns = now_ns();
+    if (strcmp(env, "perf") == 0) stats_perf_open();
+    atexit(stats_atexit);
+    stats_phase(first);
+}
+
+#endif
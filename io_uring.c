@@ -1,16 +1,67 @@
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
 #include<stdbool.h>
+#include<stdint.h>
 #include<unistd.h>
+#include<getopt.h>
 #include<sys/stat.h>
 #include<sys/types.h>
 #include<fcntl.h>
 #include<liburing.h>
 #include<time.h>
 
-static long long timespec_to_ns(const struct timespec *t){
-     return (long long)t->tv_sec*1000000000LL + t->tv_nsec;
+#include "bench_common.h"
+#include "lat_hist.h"
+#include "workload.h"
+#include "io_stats.h"
+#include "placement.h"
+
+enum sync_mode {
+     SYNC_NONE,
+     SYNC_FSYNC,
+     SYNC_FDATASYNC,
+     SYNC_FILE_RANGE
+};
+
+// user_data tags so the completion loop can tell the write and its linked sync apart
+#define TAG_WRITE 1
+#define TAG_SYNC  2
+#define TAG_READ  3
+
+static const char *sync_mode_name(enum sync_mode m){
+     switch(m){
+     case SYNC_FSYNC:      return "fsync";
+     case SYNC_FDATASYNC:  return "fdatasync";
+     case SYNC_FILE_RANGE: return "sync_file_range";
+     default:              return "none";
+     }
+}
+
+static int parse_sync_mode(const char *s, enum sync_mode *out){
+     if(strcmp(s, "none") == 0) *out = SYNC_NONE;
+     else if(strcmp(s, "fsync") == 0) *out = SYNC_FSYNC;
+     else if(strcmp(s, "fdatasync") == 0 || strcmp(s, "datasync") == 0) *out = SYNC_FDATASYNC;
+     else if(strcmp(s, "sfr") == 0 || strcmp(s, "sync_file_range") == 0) *out = SYNC_FILE_RANGE;
+     else return -1;
+     return 0;
+}
+
+static void usage(const char *prog){
+     fprintf(stderr,
+          "Usage: %s [options] [file] [write_size] [total_mb]\n"
+          "  --sync        none, fsync, fdatasync or sfr; linked after the write with IOSQE_IO_LINK (default none)\n"
+          "  --sync-every  issue the linked sync every K writes (default 1)\n"
+          "  --pattern     seq, uniform (rand) or zipf offsets (default seq)\n"
+          "  --read-pct    percent of ops that are reads; the file is pre-filled (default 0)\n"
+          "  --seed        RNG seed for offsets and the read/write mix (default 1)\n"
+          "  --zipf-theta  skew for the zipf pattern, in (0, 1) (default 0.99)\n"
+          "  --hist-out    dump the full latency distributions as CSV to FILE\n"
+          "  --cpu         pin the submitting thread to the first CPU of LIST (e.g. 2 or 0-3)\n"
+          "  --mem-bind    buffer node: first-touch, local, dev (the file's device) or a node number\n"
+          "  --huge-pages  back the buffers with none, thp or hugetlb pages (default none)\n",
+          prog);
 }
 
 int main(int argc, char **argv){
@@ -18,44 +69,161 @@ int main(int argc, char **argv){
 
      size_t write_size = 4096; //block size 4KB
      size_t total_mb = 64; //total size 64MB
+     enum sync_mode sync_mode = SYNC_NONE;
+     size_t sync_every = 1;
+     const char *hist_out = NULL;
+     enum access_pattern pattern = PATTERN_SEQ;
+     unsigned read_pct = 0;
+     uint64_t seed = 1;
+     double zipf_theta = ZIPF_DEFAULT_THETA;
+     struct placement place;
+     place_init(&place);
 
-     if(argc>=2){
-          fileName = argv[1];
+     static const struct option long_opts[] = {
+          {"sync",       required_argument, NULL, 's'},
+          {"sync-every", required_argument, NULL, 'k'},
+          {"pattern",    required_argument, NULL, 'p'},
+          {"read-pct",   required_argument, NULL, 'r'},
+          {"seed",       required_argument, NULL, 'S'},
+          {"zipf-theta", required_argument, NULL, 'z'},
+          {"hist-out",   required_argument, NULL, 'H'},
+          {"cpu",        required_argument, NULL, 'c'},
+          {"mem-bind",   required_argument, NULL, 'm'},
+          {"huge-pages", required_argument, NULL, 'g'},
+          {"help",       no_argument,       NULL, 'h'},
+          {NULL, 0, NULL, 0}
+     };
+     int opt;
+     while((opt = getopt_long(argc, argv, "s:k:p:r:S:z:H:c:m:g:h", long_opts, NULL)) != -1)
+     {
+          switch(opt){
+          case 's':
+               if(parse_sync_mode(optarg, &sync_mode) < 0){
+                    fprintf(stderr, "unknown sync mode: %s\n", optarg);
+                    usage(argv[0]);
+                    return 1;
+               }
+               break;
+          case 'k':
+               sync_every = (size_t)strtoull(optarg, NULL, 10);
+               if(sync_every == 0){
+                    fprintf(stderr, "--sync-every must be >= 1\n");
+                    return 1;
+               }
+               break;
+          case 'p':
+               if(parse_pattern(optarg, &pattern) < 0){
+                    fprintf(stderr, "unknown pattern: %s\n", optarg);
+                    return 1;
+               }
+               break;
+          case 'r':
+               read_pct = (unsigned)strtoul(optarg, NULL, 10);
+               if(read_pct > 100) read_pct = 100;
+               break;
+          case 'S':
+               seed = strtoull(optarg, NULL, 10);
+               break;
+          case 'z':
+               zipf_theta = strtod(optarg, NULL);
+               if(!zipf_theta_valid(zipf_theta)){
+                    fprintf(stderr, "zipf theta must be between 0 and 1 (exclusive)\n");
+                    return 1;
+               }
+               break;
+          case 'H':
+               hist_out = optarg;
+               break;
+          case 'c':
+               if(place_parse_cpus(&place, optarg) < 0){
+                    fprintf(stderr, "bad cpu list: %s\n", optarg);
+                    return 1;
+               }
+               break;
+          case 'm':
+               if(place_parse_bind(&place, optarg) < 0){
+                    fprintf(stderr, "unknown mem-bind: %s\n", optarg);
+                    return 1;
+               }
+               break;
+          case 'g':
+               if(place_parse_huge(&place, optarg) < 0){
+                    fprintf(stderr, "unknown huge-pages mode: %s\n", optarg);
+                    return 1;
+               }
+               break;
+          default:
+               usage(argv[0]);
+               return opt == 'h' ? 0 : 1;
+          }
      }
-     if(argc>=3)
+
+     if(argc-optind>=1){
+          fileName = argv[optind];
+     }
+     if(argc-optind>=2)
      {
-          write_size = (size_t)atoi(argv[2]);
+          write_size = (size_t)atoi(argv[optind+1]);
      }
-      if(argc>=4)
+      if(argc-optind>=3)
      {
-          total_mb = (size_t)atoi(argv[3]);
+          total_mb = (size_t)atoi(argv[optind+2]);
      }
 
+     stats_init(argv[0], "setup");
+
      size_t iterations = (total_mb*1024*1024)/write_size;
      if (iterations == 0) {
         fprintf(stderr, "Bad args: too few iterations\n");
         return 1;
      }
 
-     int fd = open(fileName, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+     // reads need real data under every offset, so mixed runs keep a pre-filled file
+     if(read_pct > 0 && prefill_file(fileName, (uint64_t)iterations * write_size) < 0)
+     {
+          return 1;
+     }
+
+     int fd = open(fileName, read_pct > 0 ? O_RDWR : (O_CREAT | O_WRONLY | O_TRUNC), 0644);
      if(fd<0)
      {
           perror("open");
           return 1;
      }
 
-     unsigned char *buffer = malloc(write_size);
-     if(!buffer)
+     // pinned before the buffers exist, so "local" and first touch mean this CPU's node
+     if(place_pin(&place, 0) < 0)
      {
-          perror("malloc");
           return 1;
      }
+     place_resolve(&place, fd);
+     // one thread does all the I/O, so it also faults in the whole buffer
+     place.toucher = "the submitting thread";
+
+     // reads land in their own half so the write pattern stays intact
+     struct place_buf bufs;
+     if(place_alloc(&place, &bufs, 2 * write_size, 1) < 0)
+     {
+          perror("buffer mmap");
+          return 1;
+     }
+     unsigned char *buffer = bufs.mem;
+     unsigned char *read_buffer = bufs.mem + write_size;
 
-     for(int i=0; i<write_size; i++)
+     for(size_t i=0; i<write_size; i++)
      {
           buffer[i] = (unsigned char)(i & 0xFF);
      }
 
+     // submit timestamps of the writes covered by the next sync, so each one
+     // gets its own write-to-durable latency when that sync completes
+     long long *group_start_ns = malloc(sync_every * sizeof(*group_start_ns));
+     if(!group_start_ns)
+     {
+          perror("malloc");
+          return 1;
+     }
+
      struct io_uring ring;
      //initalise the ring queue
      if(io_uring_queue_init(32, &ring, 0) < 0)
@@ -64,56 +232,196 @@ int main(int argc, char **argv){
           return 1;
      }
 
-     struct timespec tstart, tend;
-     long long min_ns = (1LL<<62), max_ns = 0, sum_ns = 0;
+     static struct lat_hist write_lat, read_lat, durable_lat;
+     lat_hist_init(&write_lat);
+     lat_hist_init(&read_lat);
+     lat_hist_init(&durable_lat);
+     size_t syncs = 0;
+     size_t group_len = 0;
+     off_t group_lo = 0, group_hi = 0; // byte range written since the last sync
+
+     struct op_gen gen;
+     struct io_op op;
+     op_gen_init(&gen, pattern, read_pct, write_size, iterations, iterations, zipf_theta, seed);
 
-     printf("io_uring demo:: total ops: %zu, bytes/write: %zu\n", iterations, write_size);
-     
-     for(size_t i=0; i<iterations; i++)
+     printf("io_uring demo:: total ops: %zu, bytes/write: %zu, sync: %s every %zu, pattern: %s, reads: %u%%\n",
+            iterations, write_size, sync_mode_name(sync_mode), sync_every, pattern_name(pattern), read_pct);
+     place_report(stdout, &place, &bufs);
+
+     stats_phase("io");
+     long long run_start = now_ns();
+     for(size_t i=0; ; i++)
      {
-          struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-          if(!sqe)
+          // once the ops run out, one more pass flushes writes still waiting for a sync
+          bool have_op = op_next(&gen, &op);
+          if(!have_op && group_len == 0)
           {
-               fprintf(stderr, "uring get sqe failed");
-               return 1;
+               break;
           }
 
-          off_t offset = i*(off_t)(write_size);
+          long long start = now_ns();
+          bool do_sync = false;
+          int pending = 0;
+          struct io_uring_sqe *sqe = NULL;
 
-          clock_gettime(CLOCK_MONOTONIC, &tstart);
+          if(have_op)
+          {
+               sqe = io_uring_get_sqe(&ring);
+               if(!sqe)
+               {
+                    fprintf(stderr, "uring get sqe failed");
+                    return 1;
+               }
+               pending++;
 
-          io_uring_prep_write(sqe, fd, buffer, write_size, offset);
-          io_uring_submit(&ring);
+               if(op.is_read)
+               {
+                    io_uring_prep_read(sqe, fd, read_buffer, write_size, op.offset);
+                    io_uring_sqe_set_data64(sqe, TAG_READ);
+               }
+               else
+               {
+                    off_t end = op.offset + (off_t)write_size;
+                    if(group_len == 0 || op.offset < group_lo) group_lo = op.offset;
+                    if(group_len == 0 || end > group_hi) group_hi = end;
 
-          struct io_uring_cqe *cqe;
-          int ret = io_uring_wait_cqe(&ring, &cqe);
-          if(ret<0)
+                    if(sync_mode != SYNC_NONE)
+                    {
+                         group_start_ns[group_len++] = start;
+                         do_sync = group_len == sync_every || i == iterations - 1;
+                    }
+                    io_uring_prep_write(sqe, fd, buffer, write_size, op.offset);
+                    io_uring_sqe_set_data64(sqe, TAG_WRITE);
+               }
+          }
+          else
           {
-               fprintf(stderr, "wait cqe error\n");
-               return 1;
+               do_sync = true;
           }
-          if(cqe->res != (int)write_size)
+
+          if(do_sync)
           {
-               fprintf(stderr, "short write: %d\n", cqe->res);
-               return 1;
+               // the sync only starts once the write has completed successfully
+               if(sqe)
+               {
+                    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+               }
+
+               struct io_uring_sqe *ssqe = io_uring_get_sqe(&ring);
+               if(!ssqe)
+               {
+                    fprintf(stderr, "uring get sqe failed");
+                    return 1;
+               }
+               if(sync_mode == SYNC_FILE_RANGE)
+               {
+                    // flushes the group's dirty pages, but not the device cache or
+                    // file metadata, so it is cheaper and weaker than fdatasync.
+                    // The SQE length is 32 bits; a wider span syncs to EOF (length 0)
+                    off_t span = group_hi - group_lo;
+                    io_uring_prep_sync_file_range(ssqe, fd, span > (off_t)UINT32_MAX ? 0 : (unsigned)span, group_lo,
+                                                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                                  SYNC_FILE_RANGE_WAIT_AFTER);
+               }
+               else
+               {
+                    io_uring_prep_fsync(ssqe, fd, sync_mode == SYNC_FDATASYNC ? IORING_FSYNC_DATASYNC : 0);
+               }
+               io_uring_sqe_set_data64(ssqe, TAG_SYNC);
+               pending++;
           }
 
-          clock_gettime(CLOCK_MONOTONIC, &tend);
+          io_uring_submit(&ring);
+          stats_submit();
 
-          long long ns = timespec_to_ns(&tend) - timespec_to_ns(&tstart);
-          sum_ns += ns;
-          if (ns < min_ns) min_ns = ns;
-          if (ns > max_ns) max_ns = ns;
+          for(; pending > 0; pending--)
+          {
+               struct io_uring_cqe *cqe;
+               int ret = io_uring_wait_cqe(&ring, &cqe);
+               if(ret<0)
+               {
+                    fprintf(stderr, "wait cqe error\n");
+                    return 1;
+               }
+               long long done = now_ns();
+               uint64_t tag = io_uring_cqe_get_data64(cqe);
 
-          io_uring_cqe_seen(&ring, cqe);
+               if(tag == TAG_WRITE || tag == TAG_READ)
+               {
+                    if(cqe->res != (int)write_size)
+                    {
+                         fprintf(stderr, "short %s: %d\n", tag == TAG_READ ? "read" : "write", cqe->res);
+                         return 1;
+                    }
+                    lat_hist_record(tag == TAG_READ ? &read_lat : &write_lat, done - start);
+                    stats_op((uint64_t)cqe->res);
+               }
+               else
+               {
+                    if(cqe->res < 0)
+                    {
+                         fprintf(stderr, "%s failed: %s\n", sync_mode_name(sync_mode), strerror(-cqe->res));
+                         return 1;
+                    }
+                    for(size_t j=0; j<group_len; j++)
+                    {
+                         lat_hist_record(&durable_lat, done - group_start_ns[j]);
+                    }
+                    syncs++;
+                    stats_fsync_queued();
+                    group_len = 0;
+               }
+
+               io_uring_cqe_seen(&ring, cqe);
+          }
      }
-     long long avg_ns = sum_ns / iterations;
+     long long run_ns = now_ns() - run_start;
+     stats_phase("report");
+
+     static struct lat_hist all_lat;
+     lat_hist_init(&all_lat);
+     lat_hist_merge(&all_lat, &write_lat);
+     lat_hist_merge(&all_lat, &read_lat);
      printf("total ops: %zu, avg: %lld ns, fastest: %.6f s, slowest: %.3f s\n",
-           iterations, avg_ns, min_ns/1e9, max_ns/1e9);
-     
+           iterations, lat_hist_mean(&all_lat), lat_hist_min(&all_lat)/1e9, all_lat.max_ns/1e9);
+     if(write_lat.count > 0) lat_hist_print(stdout, "write", &write_lat);
+     if(read_lat.count > 0) lat_hist_print(stdout, "read", &read_lat);
+     if(durable_lat.count > 0)
+     {
+          printf("durable: syncs: %zu\n", syncs);
+          lat_hist_print(stdout, "durable", &durable_lat);
+     }
+     // only the written bytes are covered by the syncs, so reads get their own line
+     if(write_lat.count > 0)
+     {
+          printf("write throughput: %.2f MB/s (%s)\n",
+                 (double)(write_lat.count*write_size) / (1024.0*1024.0) / (run_ns/1e9),
+                 sync_mode == SYNC_NONE ? "page cache only" : "durable");
+     }
+     if(read_lat.count > 0)
+     {
+          printf("read throughput: %.2f MB/s\n",
+                 (double)(read_lat.count*write_size) / (1024.0*1024.0) / (run_ns/1e9));
+     }
+
+     if(hist_out)
+     {
+          FILE *hf = fopen(hist_out, "w");
+          if(!hf)
+          {
+               perror("open hist-out");
+               return 1;
+          }
+          fprintf(hf, "series,value_ns,count,cumulative\n");
+          lat_hist_dump(hf, "write", &write_lat);
+          lat_hist_dump(hf, "read", &read_lat);
+          lat_hist_dump(hf, "durable", &durable_lat);
+          fclose(hf);
+     }
+
      io_uring_queue_exit(&ring);
      close(fd);
-     free(buffer);
+     free(group_start_ns);
+     place_free(&bufs);
      return 0;
 }
-
@@ -0,0 +1,130 @@
+#ifndef LAT_HIST_H
+#define LAT_HIST_H
+
+/*
+ * Log-linear (HDR style) latency histogram.
+ *
+ * Values below LAT_HIST_SUB are counted exactly; above that every power of
+ * two is split into LAT_HIST_SUB/2 equal buckets, so any recorded value is
+ * reported within 1/64 (~1.6%) of itself. Recording is a clz, a shift and an
+ * increment, cheap enough to sit inside every timed loop.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LAT_HIST_SUB_BITS 7
+#define LAT_HIST_SUB      (1u << LAT_HIST_SUB_BITS)
+#define LAT_HIST_MAX_BITS 48 /* ~78 hours in ns; larger values land in the last bucket */
+#define LAT_HIST_BUCKETS  (LAT_HIST_SUB + (LAT_HIST_MAX_BITS - LAT_HIST_SUB_BITS) * (LAT_HIST_SUB / 2))
+
+struct lat_hist {
+    uint64_t count;
+    long long min_ns;
+    long long max_ns;
+    double sum_ns;
+    uint64_t buckets[LAT_HIST_BUCKETS];
+};
+
+static inline void lat_hist_init(struct lat_hist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min_ns = (1LL << 62);
+}
+
+static inline unsigned lat_hist_index(uint64_t v)
+{
+    if (v < LAT_HIST_SUB) return (unsigned)v;
+
+    unsigned msb = 63u - (unsigned)__builtin_clzll(v);
+    unsigned shift = msb - LAT_HIST_SUB_BITS + 1;
+    unsigned idx = LAT_HIST_SUB + (shift - 1) * (LAT_HIST_SUB / 2) +
+                   (unsigned)((v >> shift) - LAT_HIST_SUB / 2);
+    return idx < LAT_HIST_BUCKETS ? idx : LAT_HIST_BUCKETS - 1;
+}
+
+/* highest value that maps to bucket idx */
+static inline uint64_t lat_hist_bucket_high(unsigned idx)
+{
+    if (idx < LAT_HIST_SUB) return idx;
+
+    unsigned k = idx - LAT_HIST_SUB;
+    unsigned shift = k / (LAT_HIST_SUB / 2) + 1;
+    uint64_t top = k % (LAT_HIST_SUB / 2) + LAT_HIST_SUB / 2;
+    return ((top + 1) << shift) - 1;
+}
+
+static inline void lat_hist_record(struct lat_hist *h, long long ns)
+{
+    if (ns < 0) ns = 0;
+    h->buckets[lat_hist_index((uint64_t)ns)]++;
+    h->count++;
+    h->sum_ns += (double)ns;
+    if (ns < h->min_ns) h->min_ns = ns;
+    if (ns > h->max_ns) h->max_ns = ns;
+}
+
+static inline void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src)
+{
+    for (unsigned i = 0; i < LAT_HIST_BUCKETS; i++) dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum_ns += src->sum_ns;
+    if (src->min_ns < dst->min_ns) dst->min_ns = src->min_ns;
+    if (src->max_ns > dst->max_ns) dst->max_ns = src->max_ns;
+}
+
+static inline long long lat_hist_mean(const struct lat_hist *h)
+{
+    return h->count ? (long long)(h->sum_ns / (double)h->count) : 0;
+}
+
+static inline long long lat_hist_min(const struct lat_hist *h)
+{
+    return h->count ? h->min_ns : 0;
+}
+
+/* value at percentile p (0..100), reported as the bucket's highest value */
+static inline long long lat_hist_percentile(const struct lat_hist *h, double p)
+{
+    if (h->count == 0) return 0;
+
+    uint64_t rank = (uint64_t)((p / 100.0) * (double)h->count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > h->count) rank = h->count;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < LAT_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            long long v = (long long)lat_hist_bucket_high(i);
+            if (v > h->max_ns) v = h->max_ns;
+            if (v < h->min_ns) v = h->min_ns;
+            return v;
+        }
+    }
+    return h->max_ns;
+}
+
+static inline void lat_hist_print(FILE *out, const char *label, const struct lat_hist *h)
+{
+    fprintf(out, "%s: n=%llu min=%lld avg=%lld p50=%lld p90=%lld p99=%lld p99.9=%lld p99.99=%lld max=%lld (ns)\n",
+            label, (unsigned long long)h->count, lat_hist_min(h), lat_hist_mean(h),
+            lat_hist_percentile(h, 50.0), lat_hist_percentile(h, 90.0),
+            lat_hist_percentile(h, 99.0), lat_hist_percentile(h, 99.9),
+            lat_hist_percentile(h, 99.99), h->max_ns);
+}
+
+/* full distribution, one line per non-empty bucket: label,value_ns,count,cumulative fraction */
+static inline void lat_hist_dump(FILE *out, const char *label, const struct lat_hist *h)
+{
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < LAT_HIST_BUCKETS; i++) {
+        if (!h->buckets[i]) continue;
+        seen += h->buckets[i];
+        fprintf(out, "%s,%llu,%llu,%.6f\n", label, (unsigned long long)lat_hist_bucket_high(i),
+                (unsigned long long)h->buckets[i], (double)seen / (double)h->count);
+    }
+}
+
+#endif
@@ -0,0 +1,452 @@
+#ifndef LZ_BLOCK_H
+#define LZ_BLOCK_H
+
+/*
+ * Block compression for logs and merged outputs: a small LZ77 coder in the
+ * LZ4 block format (greedy hash-chain-free matching, 64 KiB window, no
+ * entropy stage), so it costs little more than a memcpy to write, plus a
+ * self-describing frame around every block:
+ *
+ *   magic u32 | raw_offset u64 | raw_len u32 | comp_len u32 | check u32 | payload
+ *
+ * all little endian. raw_offset is where the block's bytes start in the
+ * uncompressed stream, so any frame can be decoded on its own and blocks can
+ * be handed to different threads. comp_len == raw_len means the payload is
+ * stored as is (the block did not compress). check is FNV-1a over the
+ * payload, which is how a reader tells a torn last frame from a whole one.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define LZB_MAGIC      0x315a4c42u // "BLZ1"
+#define LZB_HDR_SIZE   24
+#define LZB_MAX_BLOCK  (8u << 20)  // largest raw block a reader accepts
+#define LZB_HASH_BITS  13
+#define LZB_MIN_MATCH  4
+#define LZB_LAST_LITERALS 5        // the format ends every block with literals
+#define LZB_MATCH_LIMIT   12       // no match may start closer than this to the end
+#define LZB_MAX_OFFSET    65535
+
+struct lzb_frame {
+    uint64_t raw_offset;
+    uint32_t raw_len;
+    uint32_t comp_len;
+    uint32_t check;
+};
+
+/* worst case payload size for n input bytes */
+static inline size_t lzb_bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+static inline uint32_t lzb_check(const uint8_t *p, size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline uint32_t lzb_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline void lzb_put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint32_t lzb_get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint32_t lzb_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZB_HASH_BITS);
+}
+
+/* a length nibble that overflowed continues in 255-valued bytes */
+static inline uint8_t *lzb_put_len(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/*
+ * Compress src into dst (at least lzb_bound(n) bytes). Returns the payload
+ * length, or 0 when the result would not be smaller than the input, in which
+ * case the caller stores the block raw.
+ */
+static inline size_t lzb_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    uint32_t table[1u << LZB_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    const uint8_t *match_limit = n > LZB_MATCH_LIMIT ? end - LZB_MATCH_LIMIT : src;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    // positions are stored +1 so an all-zero table means "no candidate"
+    while (ip < match_limit) {
+        uint32_t h = lzb_hash(lzb_read32(ip));
+        const uint8_t *ref = table[h] ? src + table[h] - 1 : NULL;
+        table[h] = (uint32_t)(ip - src) + 1;
+        if (!ref || ip - ref > LZB_MAX_OFFSET || lzb_read32(ref) != lzb_read32(ip)) {
+            ip++;
+            continue;
+        }
+
+        const uint8_t *mend = ip + LZB_MIN_MATCH, *r = ref + LZB_MIN_MATCH;
+        while (mend < end - LZB_LAST_LITERALS && *mend == *r) {
+            mend++;
+            r++;
+        }
+        size_t lit = (size_t)(ip - anchor), mlen = (size_t)(mend - ip) - LZB_MIN_MATCH;
+        if ((size_t)(oend - op) < 1 + lit + lit / 255 + 2 + mlen / 255 + 2 + LZB_LAST_LITERALS) return 0;
+
+        uint8_t *token = op++;
+        *token = (uint8_t)((lit < 15 ? lit : 15) << 4 | (mlen < 15 ? mlen : 15));
+        if (lit >= 15) op = lzb_put_len(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        size_t off = (size_t)(ip - ref);
+        *op++ = (uint8_t)off;
+        *op++ = (uint8_t)(off >> 8);
+        if (mlen >= 15) op = lzb_put_len(op, mlen - 15);
+
+        ip = anchor = mend;
+        if (ip < match_limit) table[lzb_hash(lzb_read32(ip - 2))] = (uint32_t)(ip - 2 - src) + 1;
+    }
+
+    size_t lit = (size_t)(end - anchor);
+    if ((size_t)(oend - op) < 1 + lit + lit / 255 + 1) return 0;
+    *op++ = (uint8_t)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) op = lzb_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    size_t out = (size_t)(op - dst);
+    return out < n ? out : 0;
+}
+
+/* decode exactly raw_len bytes; -1 on a malformed payload */
+static inline int lzb_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t raw_len)
+{
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + raw_len;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break; // the last sequence has literals only
+
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZB_MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - dst) || mlen > (size_t)(oend - op)) return -1;
+        const uint8_t *ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            while (mlen--) *op++ = *ref++; // overlapping copy repeats the last `off` bytes
+        }
+    }
+    return op == oend ? 0 : -1;
+}
+
+/*
+ * Build one frame for raw[0..raw_len) into out (at least LZB_HDR_SIZE +
+ * lzb_bound(raw_len) bytes); returns the frame's total size.
+ */
+static inline size_t lzb_encode_frame(uint8_t *out, const uint8_t *raw, uint32_t raw_len, uint64_t raw_offset)
+{
+    uint8_t *payload = out + LZB_HDR_SIZE;
+    size_t comp = lzb_compress(raw, raw_len, payload, lzb_bound(raw_len));
+    if (comp == 0) {
+        memcpy(payload, raw, raw_len);
+        comp = raw_len;
+    }
+    lzb_put_le32(out, LZB_MAGIC);
+    lzb_put_le32(out + 4, (uint32_t)raw_offset);
+    lzb_put_le32(out + 8, (uint32_t)(raw_offset >> 32));
+    lzb_put_le32(out + 12, raw_len);
+    lzb_put_le32(out + 16, (uint32_t)comp);
+    lzb_put_le32(out + 20, lzb_check(payload, comp));
+    return LZB_HDR_SIZE + comp;
+}
+
+/* -1 if hdr is not a plausible frame header */
+static inline int lzb_parse_hdr(const uint8_t *hdr, struct lzb_frame *f)
+{
+    if (lzb_get_le32(hdr) != LZB_MAGIC) return -1;
+    f->raw_offset = (uint64_t)lzb_get_le32(hdr + 4) | (uint64_t)lzb_get_le32(hdr + 8) << 32;
+    f->raw_len = lzb_get_le32(hdr + 12);
+    f->comp_len = lzb_get_le32(hdr + 16);
+    f->check = lzb_get_le32(hdr + 20);
+    if (f->raw_len > LZB_MAX_BLOCK || f->comp_len > f->raw_len) return -1;
+    return 0;
+}
+
+/* decode a payload that has already been read and checked against its header */
+static inline int lzb_decode_payload(const struct lzb_frame *f, const uint8_t *payload, uint8_t *raw)
+{
+    if (f->comp_len == f->raw_len) {
+        memcpy(raw, payload, f->raw_len);
+        return 0;
+    }
+    return lzb_decompress(payload, f->comp_len, raw, f->raw_len);
+}
+
+/*
+ * A header that does not parse at `pos` is a torn append if nothing after it
+ * looks like the frame that should come next: a crash can leave zeros or
+ * garbage where the last header was going to be, while a damaged frame in
+ * the middle of the stream still has good frames behind it.
+ */
+static inline int lzb_tail_torn(int fd, off_t pos, uint64_t raw)
+{
+    enum { STEP = 4096 };
+    uint8_t buf[STEP + LZB_HDR_SIZE];
+    for (off_t at = pos + 1;; at += STEP) {
+        ssize_t n = pread(fd, buf, sizeof(buf), at);
+        if (n < 0) return 0;
+        for (ssize_t i = 0; i < STEP && i + LZB_HDR_SIZE <= n; i++) {
+            struct lzb_frame f;
+            if (lzb_parse_hdr(buf + i, &f) == 0 && f.raw_offset >= raw) return 0;
+        }
+        if (n < (ssize_t)sizeof(buf)) return 1;
+    }
+}
+
+/*
+ * Streaming reader: one frame in memory at a time, however long the file.
+ * A frame cut short at the end of the file, one whose checksum does not
+ * match with nothing after it, or a header that does not parse with no frame
+ * behind it (lzb_tail_torn) ends the stream with `torn` set: that is what a
+ * crash mid-append leaves behind. A bad frame anywhere else is corruption.
+ */
+struct lzb_reader {
+    int fd;
+    uint8_t *comp, *raw;
+    size_t cap;          // capacity of comp and raw
+    uint64_t raw_pos;    // raw offset the next frame must start at
+    int torn;
+};
+
+static inline void lzb_reader_init(struct lzb_reader *r, int fd)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+}
+
+static inline void lzb_reader_free(struct lzb_reader *r)
+{
+    free(r->comp);
+    free(r->raw);
+    r->comp = r->raw = NULL;
+    r->cap = 0;
+}
+
+static inline ssize_t lzb_read_full(int fd, uint8_t *p, size_t n)
+{
+    size_t got = 0;
+    while (got < n) {
+        ssize_t k = read(fd, p + got, n - got);
+        if (k < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (k == 0) break;
+        got += (size_t)k;
+    }
+    return (ssize_t)got;
+}
+
+/* 1 with the next block in *data and *len, 0 at the end of the stream, -1 on error */
+static inline int lzb_reader_next(struct lzb_reader *r, const uint8_t **data, size_t *len)
+{
+    uint8_t hdr[LZB_HDR_SIZE];
+    ssize_t n = lzb_read_full(r->fd, hdr, sizeof(hdr));
+    if (n < 0) return -1;
+    if (n == 0) return 0;
+    struct lzb_frame f;
+    if (n < (ssize_t)sizeof(hdr)) {
+        r->torn = 1;
+        return 0;
+    }
+    if (lzb_parse_hdr(hdr, &f) < 0 || f.raw_offset != r->raw_pos) {
+        off_t pos = lseek(r->fd, 0, SEEK_CUR);
+        if (pos >= (off_t)sizeof(hdr) && lzb_tail_torn(r->fd, pos - (off_t)sizeof(hdr), r->raw_pos)) {
+            r->torn = 1;
+            return 0;
+        }
+        fprintf(stderr, "compressed stream: bad frame header at raw offset %llu\n",
+                (unsigned long long)r->raw_pos);
+        errno = EILSEQ;
+        return -1;
+    }
+
+    if (f.raw_len > r->cap) {
+        size_t cap = r->cap ? r->cap : 64 * 1024;
+        while (cap < f.raw_len) cap *= 2;
+        uint8_t *c = realloc(r->comp, cap), *w = c ? realloc(r->raw, cap) : NULL;
+        if (c) r->comp = c;
+        if (!c || !w) return -1;
+        r->raw = w;
+        r->cap = cap;
+    }
+    n = lzb_read_full(r->fd, r->comp, f.comp_len);
+    if (n < 0) return -1;
+    if ((size_t)n < f.comp_len || lzb_check(r->comp, f.comp_len) != f.check) {
+        // only acceptable as the very last frame
+        uint8_t probe;
+        if ((size_t)n == f.comp_len && lzb_read_full(r->fd, &probe, 1) != 0) {
+            fprintf(stderr, "compressed stream: checksum mismatch at raw offset %llu\n",
+                    (unsigned long long)f.raw_offset);
+            errno = EILSEQ;
+            return -1;
+        }
+        r->torn = 1;
+        return 0;
+    }
+    if (lzb_decode_payload(&f, r->comp, r->raw) < 0) {
+        fprintf(stderr, "compressed stream: corrupt block at raw offset %llu\n",
+                (unsigned long long)f.raw_offset);
+        errno = EILSEQ;
+        return -1;
+    }
+    r->raw_pos += f.raw_len;
+    *data = r->raw;
+    *len = f.raw_len;
+    return 1;
+}
+
+/*
+ * Decode the last whole frame of fd without walking the stream. Frames are at
+ * most max_frame bytes, so it starts within the last 2 * max_frame (a torn
+ * frame may follow it). 1 with a malloc'd block in *raw, 0 if that window
+ * holds no whole frame, -1 on error.
+ */
+static inline int lzb_read_last(int fd, size_t max_frame, uint8_t **raw, size_t *raw_len)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+    off_t win = (off_t)(2 * max_frame);
+    off_t from = st.st_size > win ? st.st_size - win : 0;
+    size_t n = (size_t)(st.st_size - from);
+    uint8_t *buf = malloc(n ? n : 1);
+    if (!buf) return -1;
+    if (pread(fd, buf, n, from) != (ssize_t)n) {
+        free(buf);
+        return -1;
+    }
+
+    int ret = 0;
+    for (size_t i = n >= LZB_HDR_SIZE ? n - LZB_HDR_SIZE + 1 : 0; i-- > 0;) {
+        struct lzb_frame f;
+        if (lzb_parse_hdr(buf + i, &f) < 0 || i + LZB_HDR_SIZE + f.comp_len > n) continue;
+        const uint8_t *payload = buf + i + LZB_HDR_SIZE;
+        if (lzb_check(payload, f.comp_len) != f.check) continue;
+        uint8_t *out = malloc(f.raw_len ? f.raw_len : 1);
+        if (!out) {
+            ret = -1;
+            break;
+        }
+        if (lzb_decode_payload(&f, payload, out) < 0) {
+            free(out);
+            continue;
+        }
+        *raw = out;
+        *raw_len = f.raw_len;
+        ret = 1;
+        break;
+    }
+    free(buf);
+    return ret;
+}
+
+/*
+ * Walk fd's frame headers to find where the next appended frame goes.
+ * 0: every frame is whole and *end_pos is the file size; 1: the tail is torn
+ * the way lzb_reader_next judges it (cut short, last frame failing its
+ * checksum, or an unparseable header with no frame behind it) and *end_pos is
+ * where it starts (truncate there before appending); -1: fd does not hold a
+ * frame stream.
+ */
+static inline int lzb_scan_end(int fd, off_t *end_pos, uint64_t *raw_end)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+    uint64_t raw = 0;
+    off_t pos = 0;
+    while (pos < st.st_size) {
+        uint8_t hdr[LZB_HDR_SIZE];
+        struct lzb_frame f;
+        ssize_t n = pread(fd, hdr, sizeof(hdr), pos);
+        if (n < 0) return -1;
+        if (n < (ssize_t)sizeof(hdr)) break;
+        if (lzb_parse_hdr(hdr, &f) < 0 || f.raw_offset != raw) {
+            if (lzb_tail_torn(fd, pos, raw)) break;
+            return -1;
+        }
+        off_t next = pos + LZB_HDR_SIZE + (off_t)f.comp_len;
+        if (next > st.st_size) break;
+        if (next == st.st_size) {
+            // the last frame is the one a crash could have left half written
+            uint8_t *payload = malloc(f.comp_len ? f.comp_len : 1);
+            if (!payload) return -1;
+            n = pread(fd, payload, f.comp_len, pos + LZB_HDR_SIZE);
+            int whole = n == (ssize_t)f.comp_len && lzb_check(payload, f.comp_len) == f.check;
+            free(payload);
+            if (n < 0) return -1;
+            if (!whole) break;
+        }
+        pos = next;
+        raw += f.raw_len;
+    }
+    *end_pos = pos;
+    *raw_end = raw;
+    return pos == st.st_size ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,3 @@
+hello iitm
+where is it located 
+how are you all ? 
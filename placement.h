@@ -0,0 +1,336 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+/*
+ * CPU and memory placement shared by word_count and the I/O benchmarks:
+ * pin threads to a CPU list, put buffers on a NUMA node (first touch by the
+ * pinned worker, or mbind to the worker's node, the device's node or a fixed
+ * node), and back them with transparent or hugetlbfs huge pages.
+ *
+ * Everything is requested best effort and recorded, so place_report() says
+ * what a run actually got rather than what was asked for: which node the
+ * buffer's pages really sit on comes from move_pages(), not from the policy.
+ * Only raw syscalls are used, so there is no libnuma dependency.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#endif
+
+#define PLACE_MAX_CPUS 256
+#define PLACE_HUGE_SIZE (2UL << 20)
+#define PLACE_NODE_LOCAL -2 // the node of the CPU the allocating thread is pinned to
+#define PLACE_NODE_DEV   -3 // the node of the block device under the benchmark file
+
+enum place_bind {
+    PLACE_BIND_NONE,
+    PLACE_FIRST_TOUCH, // each worker faults in the part of the buffer it uses
+    PLACE_MBIND        // MPOL_BIND the whole buffer to one node
+};
+
+enum place_huge {
+    PLACE_HUGE_NONE,
+    PLACE_HUGE_THP,    // 2 MiB aligned mapping with MADV_HUGEPAGE
+    PLACE_HUGE_TLB     // MAP_HUGETLB from the reserved pool, THP if it is empty
+};
+
+struct placement {
+    const char *cpu_spec; // as given, for the report
+    int cpus[PLACE_MAX_CPUS];
+    int ncpus;            // 0: threads float
+    enum place_bind bind;
+    int node;             // mbind target: a node, PLACE_NODE_LOCAL or PLACE_NODE_DEV
+    enum place_huge huge;
+    const char *toucher;  // who faults in PLACE_FIRST_TOUCH pages, for the report
+
+    // filled in as the placement is applied
+    int bound_node;       // node the buffer was bound to, -1 if none
+    const char *huge_used;
+};
+
+struct place_buf {
+    unsigned char *mem;
+    size_t len;
+    void *map;
+    size_t map_len;
+};
+
+static inline void place_init(struct placement *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->node = PLACE_NODE_LOCAL;
+    p->bound_node = -1;
+    p->huge_used = "base";
+    p->toucher = "each worker";
+}
+
+/* "0-3,8,10-11"; returns -1 on junk */
+static inline int place_parse_cpus(struct placement *p, const char *s)
+{
+    p->cpu_spec = s;
+    p->ncpus = 0;
+    while (*s) {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 0) return -1;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo) return -1;
+        }
+        for (long c = lo; c <= hi; c++) {
+            if (p->ncpus == PLACE_MAX_CPUS || c >= CPU_SETSIZE) return -1;
+            p->cpus[p->ncpus++] = (int)c;
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        s = end;
+    }
+    return p->ncpus > 0 ? 0 : -1;
+}
+
+/* "first-touch", "local", "dev", a node number or "none" */
+static inline int place_parse_bind(struct placement *p, const char *s)
+{
+    char *end;
+    if (strcmp(s, "none") == 0) {
+        p->bind = PLACE_BIND_NONE;
+    } else if (strcmp(s, "first-touch") == 0) {
+        p->bind = PLACE_FIRST_TOUCH;
+    } else if (strcmp(s, "local") == 0) {
+        p->bind = PLACE_MBIND;
+        p->node = PLACE_NODE_LOCAL;
+    } else if (strcmp(s, "dev") == 0) {
+        p->bind = PLACE_MBIND;
+        p->node = PLACE_NODE_DEV;
+    } else {
+        long n = strtol(s, &end, 10);
+        if (end == s || *end != '\0' || n < 0 || n >= 1024) return -1;
+        p->bind = PLACE_MBIND;
+        p->node = (int)n;
+    }
+    return 0;
+}
+
+/* "none", "thp" or "hugetlb" */
+static inline int place_parse_huge(struct placement *p, const char *s)
+{
+    if (strcmp(s, "none") == 0) p->huge = PLACE_HUGE_NONE;
+    else if (strcmp(s, "thp") == 0) p->huge = PLACE_HUGE_THP;
+    else if (strcmp(s, "hugetlb") == 0) p->huge = PLACE_HUGE_TLB;
+    else return -1;
+    return 0;
+}
+
+/* pin the calling thread to the idx-th CPU of the list (wrapping); no-op when unpinned */
+static inline int place_pin(const struct placement *p, int idx)
+{
+    if (p->ncpus == 0) return 0;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(p->cpus[idx % p->ncpus], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "pin to cpu %d: %s\n", p->cpus[idx % p->ncpus], strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* node of the CPU the calling thread is running on, -1 if unknown */
+static inline int place_current_node(void)
+{
+#ifdef SYS_getcpu
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) return (int)node;
+#endif
+    return -1;
+}
+
+/* NUMA node of the block device holding fd's file, -1 if there is none or it is unknown */
+static inline int place_dev_node(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+    dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+
+    // a partition's sysfs entry has no device link of its own; its parent disk does
+    static const char *const fmts[] = {"/sys/dev/block/%u:%u/device/numa_node",
+                                       "/sys/dev/block/%u:%u/../device/numa_node"};
+    for (int i = 0; i < 2; i++) {
+        char path[128];
+        snprintf(path, sizeof(path), fmts[i], major(dev), minor(dev));
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        int node = -1;
+        if (fscanf(f, "%d", &node) != 1) node = -1;
+        fclose(f);
+        return node;
+    }
+    return -1;
+}
+
+/*
+ * Decide the mbind node once the allocating thread is pinned; `fd` is the
+ * benchmark file for PLACE_NODE_DEV. Leaves bound_node at -1 and says why
+ * when there is nothing to bind to.
+ */
+static inline void place_resolve(struct placement *p, int fd)
+{
+    if (p->bind != PLACE_MBIND) return;
+    if (p->node == PLACE_NODE_LOCAL) {
+        p->bound_node = place_current_node();
+    } else if (p->node == PLACE_NODE_DEV) {
+        p->bound_node = place_dev_node(fd);
+        if (p->bound_node < 0) fprintf(stderr, "placement: device reports no NUMA node; memory left unbound\n");
+    } else {
+        p->bound_node = p->node;
+    }
+}
+
+static inline int place_thp_disabled(void)
+{
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (!f) return 0;
+    char line[128] = "";
+    if (!fgets(line, sizeof(line), f)) line[0] = '\0';
+    fclose(f);
+    return strstr(line, "[never]") != NULL;
+}
+
+/*
+ * Map len bytes with the requested page size and node binding. With `touch`
+ * the pages are faulted in here; leave it off for PLACE_FIRST_TOUCH so the
+ * workers fault in their own parts.
+ */
+static inline int place_alloc(struct placement *p, struct place_buf *b, size_t len, int touch)
+{
+    memset(b, 0, sizeof(*b));
+    b->len = len;
+    size_t rounded = (len + PLACE_HUGE_SIZE - 1) / PLACE_HUGE_SIZE * PLACE_HUGE_SIZE;
+    if (rounded == 0) rounded = PLACE_HUGE_SIZE;
+
+    if (p->huge == PLACE_HUGE_TLB) {
+#ifdef MAP_HUGETLB
+        void *m = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (m != MAP_FAILED) {
+            b->map = b->mem = m;
+            b->map_len = rounded;
+            p->huge_used = "hugetlb";
+        }
+#endif
+    }
+    if (!b->map && p->huge != PLACE_HUGE_NONE) {
+        // over-map by one huge page so the buffer can start on a 2 MiB boundary
+        void *m = mmap(NULL, rounded + PLACE_HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) return -1;
+        b->map = m;
+        b->map_len = rounded + PLACE_HUGE_SIZE;
+        b->mem = (unsigned char *)(((uintptr_t)m + PLACE_HUGE_SIZE - 1) & ~(uintptr_t)(PLACE_HUGE_SIZE - 1));
+        const char *fallback = p->huge == PLACE_HUGE_TLB ? "thp (hugetlb pool empty)" : "thp";
+#ifdef MADV_HUGEPAGE
+        if (place_thp_disabled()) p->huge_used = "base (THP disabled)";
+        else if (madvise(b->mem, rounded, MADV_HUGEPAGE) == 0) p->huge_used = fallback;
+        else p->huge_used = "base (madvise failed)";
+#else
+        p->huge_used = "base (no MADV_HUGEPAGE)";
+#endif
+    }
+    if (!b->map) {
+        long page = sysconf(_SC_PAGESIZE);
+        size_t map_len = page > 0 ? (len + (size_t)page - 1) / (size_t)page * (size_t)page : len;
+        void *m = mmap(NULL, map_len ? map_len : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) return -1;
+        b->map = b->mem = m;
+        b->map_len = map_len ? map_len : 1;
+    }
+
+#if defined(__linux__) && defined(SYS_mbind)
+    if (p->bind == PLACE_MBIND && p->bound_node >= 0) {
+        unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {0};
+        mask[p->bound_node / (8 * sizeof(unsigned long))] |= 1UL << (p->bound_node % (8 * sizeof(unsigned long)));
+        uintptr_t start = (uintptr_t)b->map;
+        size_t span = b->map_len;
+        if (syscall(SYS_mbind, start, span, MPOL_BIND, mask, 1024UL, MPOL_MF_STRICT | MPOL_MF_MOVE) < 0) {
+            fprintf(stderr, "placement: mbind to node %d: %s; memory left unbound\n", p->bound_node,
+                    strerror(errno));
+            p->bound_node = -1;
+        }
+    }
+#endif
+
+    if (touch) memset(b->mem, 0, len);
+    return 0;
+}
+
+static inline void place_free(struct place_buf *b)
+{
+    if (b->map) munmap(b->map, b->map_len);
+    memset(b, 0, sizeof(*b));
+}
+
+/* the distinct nodes a sample of the buffer's pages sits on, e.g. "0" or "0,1" */
+static inline void place_page_nodes(const struct place_buf *b, char *out, size_t cap)
+{
+    snprintf(out, cap, "unknown");
+#if defined(__linux__) && defined(SYS_move_pages)
+    enum { SAMPLES = 64 };
+    void *pages[SAMPLES];
+    int status[SAMPLES];
+    long page = sysconf(_SC_PAGESIZE);
+    if (page <= 0 || b->len == 0) return;
+    size_t npages = (b->len + (size_t)page - 1) / (size_t)page;
+    unsigned long n = npages < SAMPLES ? npages : SAMPLES;
+    for (unsigned long i = 0; i < n; i++) {
+        size_t pg = npages * i / n;
+        pages[i] = b->mem + pg * (size_t)page;
+    }
+    // with no target nodes move_pages only reports where each page is
+    if (syscall(SYS_move_pages, 0, n, pages, NULL, status, 0) < 0) return;
+
+    uint64_t seen = 0;
+    int other = 0, missing = 0;
+    for (unsigned long i = 0; i < n; i++) {
+        if (status[i] >= 0 && status[i] < 64) seen |= 1ULL << status[i];
+        else if (status[i] >= 64) other = 1;
+        else missing = 1;
+    }
+    size_t len = 0;
+    out[0] = '\0';
+    for (int node = 0; node < 64 && len < cap; node++) {
+        if (seen & (1ULL << node)) len += (size_t)snprintf(out + len, cap - len, "%s%d", len ? "," : "", node);
+    }
+    if (other && len < cap) len += (size_t)snprintf(out + len, cap - len, "%s>63", len ? "," : "");
+    if (missing && len < cap) snprintf(out + len, cap - len, "%snot faulted", len ? ", some " : "");
+#endif
+}
+
+/* one line naming the placement a run actually used */
+static inline void place_report(FILE *f, const struct placement *p, const struct place_buf *b)
+{
+    char nodes[128];
+    place_page_nodes(b, nodes, sizeof(nodes));
+    fprintf(f, "placement: cpus %s, memory ", p->ncpus ? p->cpu_spec : "unpinned");
+    if (p->bind == PLACE_FIRST_TOUCH) {
+        fprintf(f, "first-touch by %s", p->toucher);
+    } else if (p->bind == PLACE_MBIND && p->bound_node >= 0) {
+        fprintf(f, "mbind node %d%s", p->bound_node,
+                p->node == PLACE_NODE_LOCAL ? " (local)" : p->node == PLACE_NODE_DEV ? " (device)" : "");
+    } else {
+        fprintf(f, "default policy");
+    }
+    fprintf(f, ", pages %s, resident on node(s) %s\n", p->huge_used, nodes);
+}
+
+#endif
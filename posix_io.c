@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<stdlib.h>
 #include<stdint.h>
@@ -9,30 +10,123 @@
 #include<time.h>
 #include<aio.h>
 #include<string.h>
+#include<getopt.h>
 
+#include "bench_common.h"
+#include "lat_hist.h"
+#include "workload.h"
+#include "io_stats.h"
+#include "placement.h"
 
-static long long timespec_to_ns(const struct timespec *t)
+static void usage(const char *prog)
 {
-     return (long long)t->tv_sec*1000000000LL + t->tv_nsec;
+     fprintf(stderr,
+          "Usage: %s [options] [file] [write_size] [write_mb]\n"
+          "  --pattern     seq, uniform (rand) or zipf offsets (default seq)\n"
+          "  --read-pct    percent of ops that are reads; the file is pre-filled (default 0)\n"
+          "  --seed        RNG seed for offsets and the read/write mix (default 1)\n"
+          "  --zipf-theta  skew for the zipf pattern, in (0, 1) (default 0.99)\n"
+          "  --hist-out    dump the full latency distributions as CSV to FILE\n"
+          "  --cpu         pin the submitting thread to the first CPU of LIST; the AIO threads\n"
+          "                it starts inherit that one CPU (e.g. 2 or 0-3)\n"
+          "  --mem-bind    buffer node: first-touch, local, dev (the file's device) or a node number\n"
+          "  --huge-pages  back the buffers with none, thp or hugetlb pages (default none)\n",
+          prog);
 }
 
 int main(int argc, char **argv){
      char *fileName = "posixio.bin";
      size_t write_size = 4096;
      size_t write_mb = 64;
+     const char *hist_out = NULL;
+     enum access_pattern pattern = PATTERN_SEQ;
+     unsigned read_pct = 0;
+     uint64_t seed = 1;
+     double zipf_theta = ZIPF_DEFAULT_THETA;
+     struct placement place;
+     place_init(&place);
 
-     if(argc>=2){
-          fileName = argv[1];
+     static const struct option long_opts[] = {
+          {"pattern",    required_argument, NULL, 'p'},
+          {"read-pct",   required_argument, NULL, 'r'},
+          {"seed",       required_argument, NULL, 'S'},
+          {"zipf-theta", required_argument, NULL, 'z'},
+          {"hist-out",   required_argument, NULL, 'H'},
+          {"cpu",        required_argument, NULL, 'c'},
+          {"mem-bind",   required_argument, NULL, 'm'},
+          {"huge-pages", required_argument, NULL, 'g'},
+          {"help",       no_argument,       NULL, 'h'},
+          {NULL, 0, NULL, 0}
+     };
+     int opt;
+     while((opt = getopt_long(argc, argv, "p:r:S:z:H:c:m:g:h", long_opts, NULL)) != -1)
+     {
+          switch(opt){
+          case 'p':
+               if(parse_pattern(optarg, &pattern) < 0)
+               {
+                    fprintf(stderr, "unknown pattern: %s\n", optarg);
+                    return 1;
+               }
+               break;
+          case 'r':
+               read_pct = (unsigned)strtoul(optarg, NULL, 10);
+               if(read_pct > 100) read_pct = 100;
+               break;
+          case 'S':
+               seed = strtoull(optarg, NULL, 10);
+               break;
+          case 'z':
+               zipf_theta = strtod(optarg, NULL);
+               if(!zipf_theta_valid(zipf_theta))
+               {
+                    fprintf(stderr, "zipf theta must be between 0 and 1 (exclusive)\n");
+                    return 1;
+               }
+               break;
+          case 'H':
+               hist_out = optarg;
+               break;
+          case 'c':
+               if(place_parse_cpus(&place, optarg) < 0)
+               {
+                    fprintf(stderr, "bad cpu list: %s\n", optarg);
+                    return 1;
+               }
+               break;
+          case 'm':
+               if(place_parse_bind(&place, optarg) < 0)
+               {
+                    fprintf(stderr, "unknown mem-bind: %s\n", optarg);
+                    return 1;
+               }
+               break;
+          case 'g':
+               if(place_parse_huge(&place, optarg) < 0)
+               {
+                    fprintf(stderr, "unknown huge-pages mode: %s\n", optarg);
+                    return 1;
+               }
+               break;
+          default:
+               usage(argv[0]);
+               return opt == 'h' ? 0 : 1;
+          }
+     }
+
+     if(argc-optind>=1){
+          fileName = argv[optind];
      }
 
-      if(argc>=3)
+      if(argc-optind>=2)
      {
-          write_size = (size_t)strtoull(argv[2], NULL, 10);
+          write_size = (size_t)strtoull(argv[optind+1], NULL, 10);
      }
-     if(argc>=4)
+     if(argc-optind>=3)
      {
-          write_mb = (size_t)strtoull(argv[3], NULL, 10);
+          write_mb = (size_t)strtoull(argv[optind+2], NULL, 10);
      }
+     stats_init(argv[0], "setup");
 
      size_t iterations = (write_mb*1024*1024)/write_size;
      if(iterations==0){
@@ -40,19 +134,37 @@ int main(int argc, char **argv){
           return 1;
      }
 
-     int fd = open(fileName, O_CREAT | O_WRONLY | O_TRUNC, 0664);
+     // reads need real data under every offset, so mixed runs keep a pre-filled file
+     if(read_pct > 0 && prefill_file(fileName, (uint64_t)iterations * write_size) < 0)
+     {
+          return 1;
+     }
+
+     int fd = open(fileName, read_pct > 0 ? O_RDWR : (O_CREAT | O_WRONLY | O_TRUNC), 0664);
      if(fd<0)
      {
           perror("file open");
           return 1;
      }
 
-     unsigned char *buffer = malloc(write_size);
-     if(!buffer)
+     // glibc's AIO helper threads inherit the affinity of the thread that starts them
+     if(place_pin(&place, 0) < 0)
+     {
+          return 1;
+     }
+     place_resolve(&place, fd);
+     // one thread does all the I/O, so it also faults in the whole buffer
+     place.toucher = "the submitting thread";
+
+     // reads land in their own half so the write pattern stays intact
+     struct place_buf bufs;
+     if(place_alloc(&place, &bufs, 2 * write_size, 1) < 0)
      {
-          perror("malloc");
+          perror("buffer mmap");
           return 1;
      }
+     unsigned char *buffer = bufs.mem;
+     unsigned char *read_buffer = bufs.mem + write_size;
      //filling the buffer 
      for(size_t iterator=0; iterator<write_size; iterator++)
      {
@@ -67,20 +179,27 @@ int main(int argc, char **argv){
      }
 
      struct timespec tstart, tend;
-     long long min_ns = (1LL<<62), max_ns = 0, sum_ns = 0;
+     static struct lat_hist write_lat, read_lat;
+     lat_hist_init(&write_lat);
+     lat_hist_init(&read_lat);
 
-     printf("Posix AIO demo :: total operations: %zu total bytes write: %zu\n", iterations, write_size);
+     struct op_gen gen;
+     struct io_op op;
+     op_gen_init(&gen, pattern, read_pct, write_size, iterations, iterations, zipf_theta, seed);
 
-     for(size_t iterator=0; iterator<iterations; iterator++)
-     {
-          off_t offset = iterator * (off_t)write_size;
+     printf("Posix AIO demo :: total operations: %zu total bytes write: %zu, pattern: %s, reads: %u%%\n",
+            iterations, write_size, pattern_name(pattern), read_pct);
+     place_report(stdout, &place, &bufs);
 
+     stats_phase("io");
+     for(size_t iterator=0; op_next(&gen, &op); iterator++)
+     {
           memset(&cbs[iterator], 0, sizeof(struct aiocb));
 
           cbs[iterator].aio_fildes = fd;
-          cbs[iterator].aio_buf = buffer;
+          cbs[iterator].aio_buf = op.is_read ? read_buffer : buffer;
           cbs[iterator].aio_nbytes = write_size;
-          cbs[iterator].aio_offset = offset;
+          cbs[iterator].aio_offset = op.offset;
 
           if(clock_gettime(CLOCK_MONOTONIC, &tstart) < 0)
           {
@@ -88,14 +207,16 @@ int main(int argc, char **argv){
                return 1;
           }
 
-          if(aio_write(&cbs[iterator]) < 0)
+          if((op.is_read ? aio_read(&cbs[iterator]) : aio_write(&cbs[iterator])) < 0)
           {
-               perror("aio write");
+               perror(op.is_read ? "aio read" : "aio write");
                return 1;
           }
+          stats_submit();
 
           const struct aiocb *list[1] = {&cbs[iterator]};
           int ret = aio_suspend(list, 1, NULL);
+          stats_syscalls(1);
           if(ret < 0)
           {
                perror("aio suspend");
@@ -115,6 +236,7 @@ int main(int argc, char **argv){
                fprintf(stderr, "aio_return size is short than expected: %zd\n", return_size);
                return 1;
           }
+          stats_op((uint64_t)return_size);
 
           if(clock_gettime(CLOCK_MONOTONIC, &tend) < 0)
           {
@@ -122,19 +244,35 @@ int main(int argc, char **argv){
                return 1;
           }
 
-          long long ns = timespec_to_ns(&tend) - timespec_to_ns(&tstart);
-          sum_ns += ns;
-          if(ns<min_ns)
+          lat_hist_record(op.is_read ? &read_lat : &write_lat, timespec_to_ns(&tend) - timespec_to_ns(&tstart));
+     }
+     stats_phase("report");
+     struct lat_hist *all = &write_lat;
+     if(read_lat.count > 0)
+     {
+          static struct lat_hist merged;
+          lat_hist_init(&merged);
+          lat_hist_merge(&merged, &write_lat);
+          lat_hist_merge(&merged, &read_lat);
+          all = &merged;
+     }
+     printf("total operations: %zu, avg operation time: %lld ns, fastest: %.3f s, slowest: %.3f s\n",
+               iterations, lat_hist_mean(all), lat_hist_min(all)/1e9, all->max_ns/1e9);
+     if(write_lat.count > 0) lat_hist_print(stdout, "aio_write", &write_lat);
+     if(read_lat.count > 0) lat_hist_print(stdout, "aio_read", &read_lat);
+
+     if(hist_out)
+     {
+          FILE *hf = fopen(hist_out, "w");
+          if(!hf)
           {
-               min_ns = ns;
+               perror("open hist-out");
+               return 1;
           }
-          if(ns>max_ns)
-          {
-               max_ns = ns;
-          }  
+          fprintf(hf, "series,value_ns,count,cumulative\n");
+          lat_hist_dump(hf, "aio_write", &write_lat);
+          lat_hist_dump(hf, "aio_read", &read_lat);
+          fclose(hf);
      }
-     long long avg_ns = (long long)sum_ns/iterations;
-     printf("total operations: %zu, avg operation time: %lld ns, fastest: %.3f s, slowest: %.3f s\n",
-               iterations, avg_ns, min_ns/1e9, max_ns/1e9);
      return 0;
 }
@@ -1,153 +1,1903 @@
+#define _GNU_SOURCE
 #include <liburing.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "bench_common.h"
+#include "io_stats.h"
+#include "lz_block.h"
 
-#define MAX_FILES 3
 #define BUF_SIZE 8192 // read chunk size
+#define DEFAULT_QUEUE_DEPTH 64 // ring entries; also the cap on ops in flight
+#define SPLICE_PIPE_SIZE (1 << 20) // requested pipe capacity for the splice engine
+#define BUF_GROUP 0 // provided buffer group the buffered engine's reads select from
+#define SORT_READ_AHEAD_MAX (256 * 1024) // upper bound on each of a run's two read-ahead buffers
+#define SORT_OUT_BUF_SIZE (1 << 20) // each half of the sorted output double buffer
+#define SORT_FAN_IN 256 // most runs merged in one pass; more take intermediate passes
+#define DEFAULT_RUN_MEM (64 << 20) // run generation arena, also the merge read-ahead budget
+#define OUT_FRAME_SIZE (LZB_HDR_SIZE + lzb_bound(SORT_OUT_BUF_SIZE)) // one compressed output half
 
 enum op_type
 {
     OP_READ,
-    OP_WRITE
+    OP_WRITE,
+    OP_SPLICE_IN,  // input file -> pipe
+    OP_SPLICE_OUT, // pipe -> output file
+    OP_RUN_READ,   // sorted merge: read-ahead into a run buffer
+    OP_OUT_WRITE   // sorted merge: one half of the output double buffer
+};
+
+enum engine
+{
+    ENGINE_AUTO,     // copy_file_range, then splice, then buffered
+    ENGINE_COPY,     // copy_file_range only (reflinks on XFS/Btrfs)
+    ENGINE_SPLICE,   // io_uring IORING_OP_SPLICE through a pipe per active input
+    ENGINE_BUFFERED  // io_uring read/write through user buffers
 };
 
+// engine return values besides 0 (all bytes in place)
+#define MERGE_ERROR       -1
+#define MERGE_UNSUPPORTED  1 // nothing broken, hand the remaining bytes to the next engine
+
 struct file_ctx
 {
-    int fd;
-    char *buf;
+    int fd;          // -1 until an engine reaches this input, and again once it is done
     const char *name;
-    off_t offset;
-    int done;
+    off_t size;      // input size from stat
+    off_t out_base;  // where this input starts in the output
+    off_t copied;    // input bytes [0, copied) are already in place in the output
+    off_t next_read; // next input offset not yet handed to a read
+    int outstanding; // chunks of this input still in flight
+    int slot;        // splice engine: index of the pipe slot working on this input
+    int temp;        // sorted merge: run file created here, unlinked once merged
 };
 
 struct io_data
 {
     enum op_type type;
     struct file_ctx *ctx;
-    int len;
-    off_t offset;
+    char *buf;    // buffered engine: BUF_SIZE bytes; NULL while a read still has to select one
+    int len;      // bytes this chunk covers
+    int done;     // bytes of the chunk already transferred (short reads/writes)
+    off_t offset; // input offset of the chunk; output offset is ctx->out_base + offset
+    struct io_data *next; // freelist link
+};
+
+struct splice_slot
+{
+    int pipe_fds[2];
+    int chunk;            // pipe capacity, the most one splice pair moves
+    int in_pipe;          // bytes spliced into the pipe but not yet out of it
+    struct file_ctx *ctx; // input being moved, NULL while idle
+    struct io_data in, out;
 };
 
-int main()
+struct merge
 {
     struct io_uring ring;
-    io_uring_queue_init(64, &ring, 0);
+    unsigned depth;   // ring entries and the cap on ops in flight
+    unsigned inflight;
+    struct file_ctx *ctxs;
+    int nfiles;
+    int cursor;       // first input the running engine has not finished issuing
+    int output_fd;
+    struct io_data *pool; // depth preallocated contexts
+    struct io_data *free_list;
+    char *pool_bufs;      // buffered engine: read buffers, BUF_SIZE each
+    int no_buf_ring;      // keep one fixed buffer per context even if the kernel offers a ring
+    struct io_uring_buf_ring *buf_ring; // kernel-provided read buffers, NULL when not in use
+    unsigned ring_bufs;   // buffers registered in buf_ring (a power of two)
+    unsigned ring_free;   // of those, not yet claimed by an issued read
+    int compress;         // final output is written as lz_block frames
+};
 
-    const char *input_files[MAX_FILES] = {"file1.txt", "file2.txt", "file3.txt"};
-    struct file_ctx ctxs[MAX_FILES];
-    int output_fd = open("merged_output.txt", O_CREAT | O_WRONLY | O_TRUNC, 0644);
-    if (output_fd < 0)
+/* the SQ only runs dry when entries are still unsubmitted; flush them once and retry */
+static struct io_uring_sqe *get_sqe(struct merge *m)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&m->ring);
+    if (!sqe)
     {
-        perror("open output");
-        return 1;
+        io_uring_submit(&m->ring);
+        stats_submit();
+        sqe = io_uring_get_sqe(&m->ring);
+    }
+    if (!sqe)
+        fprintf(stderr, "io_uring: no free submission entries\n");
+    return sqe;
+}
+
+static struct io_data *pool_get(struct merge *m)
+{
+    struct io_data *data = m->free_list;
+    if (data)
+        m->free_list = data->next;
+    return data;
+}
+
+static void pool_put(struct merge *m, struct io_data *data)
+{
+    data->next = m->free_list;
+    m->free_list = data;
+}
+
+static int open_input(struct file_ctx *ctx)
+{
+    if (ctx->fd >= 0)
+        return 0;
+    ctx->fd = open(ctx->name, O_RDONLY);
+    if (ctx->fd < 0)
+    {
+        fprintf(stderr, "open %s: %s\n", ctx->name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void close_input(struct file_ctx *ctx)
+{
+    if (ctx->fd >= 0)
+    {
+        close(ctx->fd);
+        ctx->fd = -1;
     }
+}
+
+/* inputs stay open only while they have chunks left to issue or in flight */
+static void close_if_idle(struct file_ctx *ctx)
+{
+    if (ctx->outstanding == 0 && ctx->next_read >= ctx->size)
+        close_input(ctx);
+}
+
+static int queue_read(struct merge *m, struct io_data *data)
+{
+    struct io_uring_sqe *sqe = get_sqe(m);
+    if (!sqe)
+        return -1;
+    io_uring_prep_read(sqe, data->ctx->fd, data->buf + data->done,
+                       data->len - data->done, data->offset + data->done);
+    io_uring_sqe_set_data(sqe, data);
+    stats_op((uint64_t)(data->len - data->done));
+    m->inflight++;
+    return 0;
+}
+
+static int queue_write(struct merge *m, struct io_data *data)
+{
+    struct io_uring_sqe *sqe = get_sqe(m);
+    if (!sqe)
+        return -1;
+    io_uring_prep_write(sqe, m->output_fd, data->buf + data->done, data->len - data->done,
+                        data->ctx->out_base + data->offset + data->done);
+    io_uring_sqe_set_data(sqe, data);
+    stats_op((uint64_t)(data->len - data->done));
+    m->inflight++;
+    return 0;
+}
+
+/* read into whichever ring buffer the kernel picks at issue time */
+static int queue_read_select(struct merge *m, struct io_data *data)
+{
+    struct io_uring_sqe *sqe = get_sqe(m);
+    if (!sqe)
+        return -1;
+    io_uring_prep_read(sqe, data->ctx->fd, NULL, data->len, data->offset);
+    io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+    sqe->buf_group = BUF_GROUP;
+    io_uring_sqe_set_data(sqe, data);
+    stats_op((uint64_t)data->len);
+    m->inflight++;
+    return 0;
+}
+
+/* a buffer goes back to the kernel only once the write that drained it is done */
+static void recycle_ring_buf(struct merge *m, struct io_data *data)
+{
+    unsigned short bid = (unsigned short)((data->buf - m->pool_bufs) / BUF_SIZE);
+    io_uring_buf_ring_add(m->buf_ring, data->buf, BUF_SIZE, bid, io_uring_buf_ring_mask(m->ring_bufs), 0);
+    io_uring_buf_ring_advance(m->buf_ring, 1);
+    m->ring_free++;
+    data->buf = NULL;
+}
 
-    // Submit first reads
-    for (int i = 0; i < MAX_FILES; i++)
+/* hand every free context to the next chunks in input order */
+static int fill_reads(struct merge *m)
+{
+    while (m->cursor < m->nfiles)
     {
-        ctxs[i].fd = open(input_files[i], O_RDONLY);
-        if (ctxs[i].fd < 0)
+        struct file_ctx *ctx = &m->ctxs[m->cursor];
+        if (ctx->next_read >= ctx->size)
         {
-            perror("open input");
-            return 1;
+            close_if_idle(ctx);
+            m->cursor++;
+            continue;
         }
-        ctxs[i].buf = malloc(BUF_SIZE);
-        ctxs[i].name = input_files[i];
-        ctxs[i].offset = 0;
-        ctxs[i].done = 0;
+        if (!m->free_list || (m->buf_ring && m->ring_free == 0))
+            break; // backpressure: wait for a write to hand its context (or buffer) back
+        if (open_input(ctx) < 0)
+            return -1;
 
-        struct io_data *data = malloc(sizeof(*data));
+        off_t left = ctx->size - ctx->next_read;
+        struct io_data *data = pool_get(m);
         data->type = OP_READ;
-        data->ctx = &ctxs[i];
-        data->offset = 0;
-        data->len = BUF_SIZE;
+        data->ctx = ctx;
+        data->len = left < BUF_SIZE ? (int)left : BUF_SIZE;
+        data->done = 0;
+        data->offset = ctx->next_read;
+        ctx->next_read += data->len;
+        ctx->outstanding++;
+
+        if (m->buf_ring)
+        {
+            m->ring_free--; // reserved now so a read never finds the ring empty (-ENOBUFS)
+            if (queue_read_select(m, data) < 0)
+                return -1;
+        }
+        else if (queue_read(m, data) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int is_unsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EINVAL;
+}
+
+static const char *engine_name(enum engine e)
+{
+    switch (e)
+    {
+    case ENGINE_COPY:
+        return "copy_file_range";
+    case ENGINE_SPLICE:
+        return "splice";
+    case ENGINE_BUFFERED:
+        return "buffered";
+    default:
+        return "auto";
+    }
+}
 
-        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-        io_uring_prep_read(sqe, ctxs[i].fd, ctxs[i].buf, BUF_SIZE, 0);
-        io_uring_sqe_set_data(sqe, data);
+/* copy_file_range lets the filesystem share extents (reflink) or copy in-kernel */
+static int merge_copy_range(struct merge *m)
+{
+    for (int i = 0; i < m->nfiles; i++)
+    {
+        struct file_ctx *ctx = &m->ctxs[i];
+        if (ctx->copied < ctx->size && open_input(ctx) < 0)
+            return MERGE_ERROR;
+        while (ctx->copied < ctx->size)
+        {
+            loff_t in_off = ctx->copied;
+            loff_t out_off = ctx->out_base + ctx->copied;
+            ssize_t n = copy_file_range(ctx->fd, &in_off, m->output_fd, &out_off,
+                                        (size_t)(ctx->size - ctx->copied), 0);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (is_unsupported(errno))
+                    return MERGE_UNSUPPORTED;
+                fprintf(stderr, "copy_file_range on %s: %s\n", ctx->name, strerror(errno));
+                return MERGE_ERROR;
+            }
+            if (n == 0)
+            {
+                fprintf(stderr, "copy_file_range on %s: unexpected EOF\n", ctx->name);
+                return MERGE_ERROR;
+            }
+            stats_rw((uint64_t)n);
+            ctx->copied += n;
+        }
+        close_input(ctx);
+    }
+    return 0;
+}
+
+static int queue_splice_out(struct merge *m, struct splice_slot *slot)
+{
+    struct file_ctx *ctx = slot->ctx;
+    struct io_uring_sqe *sqe = get_sqe(m);
+    if (!sqe)
+        return -1;
+    slot->out.len = slot->in_pipe;
+    io_uring_prep_splice(sqe, slot->pipe_fds[0], -1, m->output_fd, ctx->out_base + ctx->copied,
+                         (unsigned)slot->in_pipe, 0);
+    io_uring_sqe_set_data(sqe, &slot->out);
+    stats_op((uint64_t)slot->in_pipe);
+    m->inflight++;
+    return 0;
+}
+
+/* queue input -> pipe linked to pipe -> output for the slot's next chunk */
+static int queue_splice_chain(struct merge *m, struct splice_slot *slot)
+{
+    struct file_ctx *ctx = slot->ctx;
+    off_t left = ctx->size - ctx->next_read;
+    int len = left < slot->chunk ? (int)left : slot->chunk;
+
+    // the pair must land in the same submission for the link to hold
+    if (io_uring_sq_space_left(&m->ring) < 2)
+    {
+        io_uring_submit(&m->ring);
+        stats_submit();
+    }
+    struct io_uring_sqe *in = get_sqe(m);
+    struct io_uring_sqe *out = in ? get_sqe(m) : NULL;
+    if (!out)
+        return -1;
+
+    slot->in.ctx = slot->out.ctx = ctx;
+    slot->in.len = slot->out.len = len;
+    io_uring_prep_splice(in, ctx->fd, ctx->next_read, slot->pipe_fds[1], -1, (unsigned)len, 0);
+    io_uring_sqe_set_flags(in, IOSQE_IO_LINK);
+    io_uring_sqe_set_data(in, &slot->in);
+
+    // a short splice-in breaks the link and the splice-out completes with -ECANCELED
+    io_uring_prep_splice(out, slot->pipe_fds[0], -1, m->output_fd, ctx->out_base + ctx->next_read,
+                         (unsigned)len, 0);
+    io_uring_sqe_set_data(out, &slot->out);
+    stats_op((uint64_t)len);
+    stats_op((uint64_t)len);
+    m->inflight += 2;
+    return 0;
+}
+
+/* give slot `index` the next input that still has bytes to move, or leave it idle */
+static int splice_assign(struct merge *m, struct splice_slot *slots, int index)
+{
+    struct splice_slot *slot = &slots[index];
+    slot->ctx = NULL;
+    while (m->cursor < m->nfiles)
+    {
+        struct file_ctx *ctx = &m->ctxs[m->cursor++];
+        ctx->next_read = ctx->copied;
+        if (ctx->copied >= ctx->size)
+            continue;
+        if (open_input(ctx) < 0)
+            return -1;
+        ctx->slot = index;
+        slot->ctx = ctx;
+        slot->in_pipe = 0;
+        return queue_splice_chain(m, slot);
+    }
+    return 0;
+}
+
+/* data moves file -> pipe -> file inside the kernel, never through user memory */
+static int merge_splice(struct merge *m)
+{
+    // each active input keeps one linked pair in flight, so half the ring bounds the slots
+    int nslots = (int)(m->depth / 2);
+    if (nslots > m->nfiles)
+        nslots = m->nfiles;
+    struct splice_slot *slots = calloc((size_t)nslots, sizeof(*slots));
+    if (!slots)
+    {
+        perror("calloc");
+        return MERGE_ERROR;
     }
-    io_uring_submit(&ring);
+    int rc = 0;
 
-    int remaining_reads = MAX_FILES;
-    int pending_ops = MAX_FILES; // initial reads
+    m->cursor = 0;
+    for (int i = 0; i < nslots; i++)
+        slots[i].pipe_fds[0] = slots[i].pipe_fds[1] = -1;
+    for (int i = 0; i < nslots && rc == 0; i++)
+    {
+        struct splice_slot *slot = &slots[i];
+        slot->in.type = OP_SPLICE_IN;
+        slot->out.type = OP_SPLICE_OUT;
+        if (pipe(slot->pipe_fds) < 0)
+        {
+            perror("pipe");
+            rc = MERGE_ERROR;
+            break;
+        }
+        fcntl(slot->pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE); // best effort
+        slot->chunk = fcntl(slot->pipe_fds[1], F_GETPIPE_SZ);
+        if (slot->chunk <= 0)
+            slot->chunk = 65536;
+        if (splice_assign(m, slots, i) < 0)
+            rc = MERGE_ERROR;
+    }
 
-    while (pending_ops > 0)
+    while (m->inflight > 0)
     {
+        // one submit per pass: everything queued while reaping goes out together
+        io_uring_submit_and_wait(&m->ring, 1);
+        stats_submit();
+
         struct io_uring_cqe *cqe;
-        io_uring_wait_cqe(&ring, &cqe);
+        unsigned head, seen = 0;
+        io_uring_for_each_cqe(&m->ring, head, cqe)
+        {
+            struct io_data *data = (struct io_data *)io_uring_cqe_get_data(cqe);
+            struct file_ctx *ctx = data->ctx;
+            struct splice_slot *slot = &slots[ctx->slot];
+            int res = cqe->res;
+            seen++;
+            m->inflight--;
+
+            if (data->type == OP_SPLICE_IN)
+            {
+                if (res > 0)
+                {
+                    slot->in_pipe += res;
+                    ctx->next_read += res;
+                }
+                else if (res == 0 || !is_unsupported(-res))
+                {
+                    fprintf(stderr, "splice from %s: %s\n", ctx->name, res ? strerror(-res) : "unexpected EOF");
+                    rc = MERGE_ERROR;
+                }
+                else if (rc == 0)
+                {
+                    rc = MERGE_UNSUPPORTED;
+                }
+                continue; // the splice-out (or its cancellation) decides what comes next
+            }
+
+            if (res > 0)
+            {
+                slot->in_pipe -= res;
+                ctx->copied += res;
+            }
+            else if (res != -ECANCELED)
+            {
+                if (res == 0 || !is_unsupported(-res))
+                {
+                    fprintf(stderr, "splice to output for %s: %s\n", ctx->name, res ? strerror(-res) : "no progress");
+                    rc = MERGE_ERROR;
+                }
+                else if (rc == 0)
+                {
+                    rc = MERGE_UNSUPPORTED;
+                }
+            }
+
+            if (rc != 0)
+                continue; // let the other slots drain, then report
+
+            int qrc;
+            if (slot->in_pipe > 0)
+                qrc = queue_splice_out(m, slot);
+            else if (ctx->next_read < ctx->size)
+                qrc = queue_splice_chain(m, slot);
+            else
+            {
+                close_input(ctx);
+                qrc = splice_assign(m, slots, ctx->slot);
+            }
+            if (qrc < 0)
+                rc = MERGE_ERROR;
+        }
+        io_uring_cq_advance(&m->ring, seen);
+    }
+
+    for (int i = 0; i < nslots; i++)
+    {
+        if (slots[i].ctx)
+            close_input(slots[i].ctx);
+        if (slots[i].pipe_fds[0] >= 0)
+        {
+            close(slots[i].pipe_fds[0]);
+            close(slots[i].pipe_fds[1]);
+        }
+    }
+    free(slots);
+    return rc;
+}
+
+/*
+ * Read buffers for the buffered engine. When the kernel supports provided
+ * buffer rings (5.19+) they are registered as one, and each read picks a free
+ * buffer when it is issued instead of a context owning one for good; the
+ * write that drains a buffer puts it back. Older kernels get one fixed buffer
+ * per context.
+ */
+static int setup_read_buffers(struct merge *m)
+{
+    unsigned nbufs = 1;
+    while (nbufs < m->depth)
+        nbufs <<= 1; // buffer rings are sized in powers of two
+    m->pool_bufs = malloc((size_t)nbufs * BUF_SIZE);
+    if (!m->pool_bufs)
+    {
+        perror("malloc");
+        return -1;
+    }
 
+    if (!m->no_buf_ring)
+    {
+        int ret;
+        m->buf_ring = io_uring_setup_buf_ring(&m->ring, nbufs, BUF_GROUP, 0, &ret);
+        if (m->buf_ring)
+        {
+            for (unsigned i = 0; i < nbufs; i++)
+                io_uring_buf_ring_add(m->buf_ring, m->pool_bufs + (size_t)i * BUF_SIZE, BUF_SIZE,
+                                      (unsigned short)i, io_uring_buf_ring_mask(nbufs), (int)i);
+            io_uring_buf_ring_advance(m->buf_ring, (int)nbufs);
+            m->ring_bufs = m->ring_free = nbufs;
+            for (unsigned i = 0; i < m->depth; i++)
+                m->pool[i].buf = NULL;
+            return 0;
+        }
+        if (ret != -EINVAL && ret != -ENOSYS && ret != -EOPNOTSUPP)
+            fprintf(stderr, "io_uring_setup_buf_ring: %s, using fixed buffers\n", strerror(-ret));
+    }
+    for (unsigned i = 0; i < m->depth; i++)
+        m->pool[i].buf = m->pool_bufs + (size_t)i * BUF_SIZE;
+    return 0;
+}
+
+/* io_uring reads into pooled buffers and positional writes back out of them */
+static int merge_buffered(struct merge *m)
+{
+    int failed = 0;
+    if (setup_read_buffers(m) < 0)
+        return MERGE_ERROR;
+    m->cursor = 0;
+    for (int i = 0; i < m->nfiles; i++)
+        m->ctxs[i].next_read = m->ctxs[i].copied;
+    if (fill_reads(m) < 0)
+        failed = 1;
+
+    while (m->inflight > 0)
+    {
+        // one submit per pass: everything queued while reaping goes out together
+        io_uring_submit_and_wait(&m->ring, 1);
+        stats_submit();
+
+        struct io_uring_cqe *cqe;
+        unsigned head, seen = 0;
+        io_uring_for_each_cqe(&m->ring, head, cqe)
+        {
+            struct io_data *data = (struct io_data *)io_uring_cqe_get_data(cqe);
+            struct file_ctx *ctx = data->ctx;
+            int res = cqe->res;
+            seen++;
+            m->inflight--;
+
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                data->buf = m->pool_bufs + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * BUF_SIZE;
+
+            if (res == -ENOBUFS && m->buf_ring && !data->buf)
+            {
+                // reservations should prevent this; the read keeps its claim and tries again
+                if (queue_read_select(m, data) < 0)
+                    failed = 1;
+                continue;
+            }
+            if (res < 0 || (res == 0 && data->type == OP_READ))
+            {
+                // 0 from a read means the input shrank after stat
+                fprintf(stderr, "%s error on %s: %s\n", data->type == OP_READ ? "read" : "write",
+                        ctx->name, res < 0 ? strerror(-res) : "unexpected EOF");
+                failed = 1;
+                ctx->outstanding--;
+                if (m->buf_ring)
+                {
+                    if (data->buf)
+                        recycle_ring_buf(m, data);
+                    else
+                        m->ring_free++; // the read never took the buffer it reserved
+                }
+                pool_put(m, data);
+                continue;
+            }
+
+            data->done += res;
+            if (data->done < data->len)
+            {
+                // short transfer: finish the rest of the chunk in the same buffer
+                if ((data->type == OP_READ ? queue_read(m, data) : queue_write(m, data)) < 0)
+                    failed = 1;
+            }
+            else if (data->type == OP_READ)
+            {
+                // Chunk is in memory: write it to its final place in the output
+                data->type = OP_WRITE;
+                data->done = 0;
+                if (queue_write(m, data) < 0)
+                    failed = 1;
+            }
+            else
+            {
+                // Write finished, the context and its buffer can take the next read
+                ctx->outstanding--;
+                close_if_idle(ctx);
+                if (m->buf_ring)
+                    recycle_ring_buf(m, data);
+                pool_put(m, data);
+            }
+        }
+        io_uring_cq_advance(&m->ring, seen);
+
+        if (!failed && fill_reads(m) < 0)
+            failed = 1;
+    }
+
+    if (m->buf_ring)
+    {
+        io_uring_free_buf_ring(&m->ring, m->buf_ring, m->ring_bufs, BUF_GROUP);
+        m->buf_ring = NULL;
+    }
+    for (int i = 0; i < m->nfiles; i++)
+        close_input(&m->ctxs[i]);
+    return failed ? MERGE_ERROR : 0;
+}
+
+/*
+ * Sorted mode: every input is a run of newline-delimited records in byte
+ * order (LC_ALL=C), and the output is their k-way merge. Each run reads ahead
+ * into two buffers through the ring while the other one is being consumed,
+ * and the output is double-buffered so one half is written while the merge
+ * fills the other.
+ */
+
+enum buf_state
+{
+    BUF_EMPTY,   // free, or the run has no bytes left for it
+    BUF_READING, // read in flight
+    BUF_READY    // io.len bytes of the run available
+};
+
+struct run_buf
+{
+    struct io_data io; // first member: a completion's io_data is the run_buf
+    enum buf_state state;
+};
+
+struct sort_run
+{
+    struct file_ctx *ctx;
+    struct run_buf bufs[2];
+    int cur;         // buffer the next record is taken from; bufs[cur ^ 1] holds the bytes after it
+    int pos;         // offset of the next record in bufs[cur]
+    const char *rec; // current record without its newline
+    size_t rec_len;
+    char *carry;     // a record that straddles buffers is assembled here
+    size_t carry_cap;
+    int queued;      // has an empty buffer waiting for an in-flight slot
+};
+
+struct sort_merge
+{
+    struct merge *m;
+    struct sort_run *runs;
+    int nruns;
+    int *heap; // run indices, smallest current record on top
+    int heap_len;
+    int *pending; // FIFO of runs waiting for an in-flight slot
+    int pending_head, npending;
+    int buf_size; // size of each read-ahead buffer
+};
+
+struct out_stream
+{
+    struct sort_merge *sm;
+    struct file_ctx file; // fd and name of the current output; writes go to file.out_base + offset
+    off_t off;            // output offset of the next half handed to a write
+    struct io_data bufs[2]; // a half is busy while done < len
+    char *raw[2];         // where out_append collects each half; bufs[i].buf unless compressing
+    int cur;
+    size_t fill;
+    uint64_t raw_off;     // compressing: uncompressed bytes handed to writes so far
+    int compress;
+};
+
+struct sort_rec
+{
+    const char *p;
+    size_t len;
+};
+
+/* byte order, shorter record first on a common prefix */
+static int rec_cmp(const char *a, size_t la, const char *b, size_t lb)
+{
+    int c = memcmp(a, b, la < lb ? la : lb);
+    if (c != 0)
+        return c;
+    return la < lb ? -1 : la > lb;
+}
+
+static int sort_rec_cmp(const void *a, const void *b)
+{
+    const struct sort_rec *x = a, *y = b;
+    return rec_cmp(x->p, x->len, y->p, y->len);
+}
+
+static int queue_stream_write(struct merge *m, struct io_data *data)
+{
+    struct io_uring_sqe *sqe = get_sqe(m);
+    if (!sqe)
+        return -1;
+    io_uring_prep_write(sqe, data->ctx->fd, data->buf + data->done, data->len - data->done,
+                        data->ctx->out_base + data->offset + data->done);
+    io_uring_sqe_set_data(sqe, data);
+    stats_op((uint64_t)(data->len - data->done));
+    m->inflight++;
+    return 0;
+}
+
+/* issue read-ahead into the run's empty buffers, in the order they will be consumed */
+static int run_fill(struct sort_merge *sm, int idx)
+{
+    struct sort_run *run = &sm->runs[idx];
+    struct file_ctx *ctx = run->ctx;
+    for (int k = 0; k < 2; k++)
+    {
+        struct run_buf *b = &run->bufs[run->cur ^ k];
+        if (b->state != BUF_EMPTY || ctx->next_read >= ctx->size)
+            continue;
+        if (sm->m->inflight >= sm->m->depth)
+        {
+            // ring is at its cap: retry when a completion frees a slot
+            if (!run->queued)
+            {
+                run->queued = 1;
+                sm->pending[(sm->pending_head + sm->npending++) % sm->nruns] = idx;
+            }
+            return 0;
+        }
+        if (open_input(ctx) < 0)
+            return -1;
+        off_t left = ctx->size - ctx->next_read;
+        b->io.len = left < sm->buf_size ? (int)left : sm->buf_size;
+        b->io.done = 0;
+        b->io.offset = ctx->next_read;
+        ctx->next_read += b->io.len;
+        b->state = BUF_READING;
+        if (queue_read(sm->m, &b->io) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* reap every ready completion, waiting for at least one, then refill queued runs */
+static int sort_wait(struct sort_merge *sm)
+{
+    struct merge *m = sm->m;
+    int failed = 0;
+    if (m->inflight == 0)
+    {
+        fprintf(stderr, "sorted merge: waiting with nothing in flight\n");
+        return -1;
+    }
+    io_uring_submit_and_wait(&m->ring, 1);
+    stats_submit();
+
+    struct io_uring_cqe *cqe;
+    unsigned head, seen = 0;
+    io_uring_for_each_cqe(&m->ring, head, cqe)
+    {
         struct io_data *data = (struct io_data *)io_uring_cqe_get_data(cqe);
-        struct file_ctx *ctx = data ? data->ctx : NULL;
+        int res = cqe->res;
+        seen++;
+        m->inflight--;
 
-        if (cqe->res < 0)
+        if (res <= 0)
         {
-            fprintf(stderr, "I/O error: %s\n", strerror(-cqe->res));
-            if (data && data->type == OP_READ && !ctx->done)
+            fprintf(stderr, "%s error on %s: %s\n", data->type == OP_RUN_READ ? "read" : "write",
+                    data->ctx->name, res < 0 ? strerror(-res) : "no progress");
+            failed = 1;
+            continue;
+        }
+        data->done += res;
+        if (data->done < data->len)
+        {
+            if ((data->type == OP_RUN_READ ? queue_read(m, data) : queue_stream_write(m, data)) < 0)
+                failed = 1;
+        }
+        else if (data->type == OP_RUN_READ)
+        {
+            ((struct run_buf *)data)->state = BUF_READY;
+        }
+    }
+    io_uring_cq_advance(&m->ring, seen);
+
+    while (!failed && sm->npending > 0 && m->inflight < m->depth)
+    {
+        int idx = sm->pending[sm->pending_head];
+        sm->pending_head = (sm->pending_head + 1) % sm->nruns;
+        sm->npending--;
+        sm->runs[idx].queued = 0;
+        if (run_fill(sm, idx) < 0)
+            failed = 1;
+    }
+    return failed ? -1 : 0;
+}
+
+/* drain whatever is still in flight after an error so no buffer is freed under the kernel */
+static void sort_drain(struct merge *m)
+{
+    while (m->inflight > 0)
+    {
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(&m->ring, &cqe) < 0)
+            break;
+        io_uring_cqe_seen(&m->ring, cqe);
+        m->inflight--;
+    }
+}
+
+/* move run idx to its next record: 1 = record ready, 0 = run exhausted, -1 = error */
+static int run_next(struct sort_merge *sm, int idx)
+{
+    struct sort_run *run = &sm->runs[idx];
+    size_t carry_len = 0;
+    int carrying = 0;
+    for (;;)
+    {
+        struct run_buf *b = &run->bufs[run->cur];
+        while (b->state == BUF_READING || (b->state == BUF_EMPTY && run->queued))
+        {
+            if (sort_wait(sm) < 0)
+                return -1;
+        }
+        if (b->state == BUF_EMPTY)
+        {
+            // end of the run; a last record without a newline still counts
+            close_input(run->ctx);
+            if (!carrying)
+                return 0;
+            run->rec = run->carry;
+            run->rec_len = carry_len;
+            return 1;
+        }
+        if (run->pos == b->io.len)
+        {
+            // buffer consumed: it goes back to read-ahead, the other one is next
+            b->state = BUF_EMPTY;
+            run->pos = 0;
+            run->cur ^= 1;
+            if (run_fill(sm, idx) < 0)
+                return -1;
+            continue;
+        }
+
+        const char *start = b->io.buf + run->pos;
+        size_t avail = (size_t)(b->io.len - run->pos);
+        const char *nl = memchr(start, '\n', avail);
+        size_t n = nl ? (size_t)(nl - start) : avail;
+        if (nl && !carrying)
+        {
+            // common case: the record lies inside one buffer and is used in place
+            run->rec = start;
+            run->rec_len = n;
+            run->pos += (int)n + 1;
+            return 1;
+        }
+
+        if (carry_len + n > run->carry_cap)
+        {
+            size_t cap = run->carry_cap ? run->carry_cap : 4096;
+            while (cap < carry_len + n)
+                cap *= 2;
+            char *p = realloc(run->carry, cap);
+            if (!p)
             {
-                ctx->done = 1;
-                remaining_reads--;
+                perror("realloc");
+                return -1;
             }
+            run->carry = p;
+            run->carry_cap = cap;
         }
-        else if (data && data->type == OP_READ)
+        memcpy(run->carry + carry_len, start, n);
+        carry_len += n;
+        carrying = 1;
+        run->pos += (int)n + (nl ? 1 : 0);
+        if (nl)
         {
-            if (cqe->res == 0)
+            run->rec = run->carry;
+            run->rec_len = carry_len;
+            return 1;
+        }
+    }
+}
+
+static void out_init(struct out_stream *o, struct sort_merge *sm, char *mem)
+{
+    memset(o, 0, sizeof(*o));
+    o->sm = sm;
+    o->file.fd = -1;
+    for (int i = 0; i < 2; i++)
+    {
+        o->bufs[i].type = OP_OUT_WRITE;
+        o->bufs[i].ctx = &o->file;
+        o->bufs[i].buf = o->raw[i] = mem + (size_t)i * SORT_OUT_BUF_SIZE;
+    }
+}
+
+/* each half becomes one frame in frames (2 * OUT_FRAME_SIZE) before it is written */
+static void out_compress(struct out_stream *o, char *frames)
+{
+    o->compress = 1;
+    for (int i = 0; i < 2; i++)
+        o->bufs[i].buf = frames + (size_t)i * OUT_FRAME_SIZE;
+}
+
+/* hand the current half to a write and switch to the other once its write is done */
+static int out_flush(struct out_stream *o)
+{
+    struct io_data *b = &o->bufs[o->cur];
+    if (o->fill == 0)
+        return 0;
+    if (o->compress)
+    {
+        // the raw half is free again as soon as it is encoded; the frame is what stays busy
+        b->len = (int)lzb_encode_frame((uint8_t *)b->buf, (const uint8_t *)o->raw[o->cur], (uint32_t)o->fill,
+                                       o->raw_off);
+        o->raw_off += o->fill;
+    }
+    else
+    {
+        b->len = (int)o->fill;
+    }
+    b->done = 0;
+    b->offset = o->off;
+    o->off += (off_t)b->len;
+    if (queue_stream_write(o->sm->m, b) < 0)
+        return -1;
+    io_uring_submit(&o->sm->m->ring); // also carries read-ahead queued since the last submit
+    stats_submit();
+
+    o->cur ^= 1;
+    o->fill = 0;
+    while (o->bufs[o->cur].done < o->bufs[o->cur].len)
+    {
+        if (sort_wait(o->sm) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int out_append(struct out_stream *o, const char *p, size_t n)
+{
+    while (n > 0)
+    {
+        size_t room = SORT_OUT_BUF_SIZE - o->fill;
+        if (room == 0)
+        {
+            if (out_flush(o) < 0)
+                return -1;
+            continue;
+        }
+        size_t c = n < room ? n : room;
+        memcpy(o->raw[o->cur] + o->fill, p, c);
+        o->fill += c;
+        p += c;
+        n -= c;
+    }
+    return 0;
+}
+
+/* flush the partial half and wait until both halves are on disk */
+static int out_finish(struct out_stream *o)
+{
+    if (out_flush(o) < 0)
+        return -1;
+    for (int i = 0; i < 2; i++)
+    {
+        while (o->bufs[i].done < o->bufs[i].len)
+        {
+            if (sort_wait(o->sm) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static int heap_less(struct sort_merge *sm, int a, int b)
+{
+    struct sort_run *x = &sm->runs[a], *y = &sm->runs[b];
+    int c = rec_cmp(x->rec, x->rec_len, y->rec, y->rec_len);
+    return c < 0 || (c == 0 && a < b); // equal records keep input order
+}
+
+static void heap_sift_down(struct sort_merge *sm, int i)
+{
+    for (;;)
+    {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < sm->heap_len && heap_less(sm, sm->heap[l], sm->heap[min]))
+            min = l;
+        if (r < sm->heap_len && heap_less(sm, sm->heap[r], sm->heap[min]))
+            min = r;
+        if (min == i)
+            return;
+        int t = sm->heap[i];
+        sm->heap[i] = sm->heap[min];
+        sm->heap[min] = t;
+        i = min;
+    }
+}
+
+/*
+ * k-way merge of sorted runs into out_fd; every record is written with a
+ * trailing newline. *written is the uncompressed size even when compressing.
+ */
+static int merge_runs(struct merge *m, struct file_ctx *runs, int nruns, size_t mem,
+                      int out_fd, const char *out_name, int compress, off_t *written)
+{
+    struct sort_merge sm;
+    struct out_stream out;
+    memset(&sm, 0, sizeof(sm));
+    sm.m = m;
+    sm.nruns = nruns;
+
+    // split the read-ahead budget over both buffers of every run
+    size_t per_buf = mem / (2 * (size_t)(nruns ? nruns : 1));
+    if (per_buf > SORT_READ_AHEAD_MAX)
+        per_buf = SORT_READ_AHEAD_MAX;
+    if (per_buf < BUF_SIZE)
+        per_buf = BUF_SIZE;
+    sm.buf_size = (int)per_buf;
+
+    sm.runs = calloc((size_t)nruns + 1, sizeof(*sm.runs));
+    sm.heap = calloc((size_t)nruns + 1, sizeof(*sm.heap));
+    sm.pending = calloc((size_t)nruns + 1, sizeof(*sm.pending));
+    char *read_bufs = malloc((size_t)nruns * 2 * per_buf + 1);
+    char *out_bufs = malloc(2 * SORT_OUT_BUF_SIZE);
+    char *frames = compress ? malloc(2 * OUT_FRAME_SIZE) : NULL;
+    if (!sm.runs || !sm.heap || !sm.pending || !read_bufs || !out_bufs || (compress && !frames))
+    {
+        perror("malloc");
+        free(sm.runs);
+        free(sm.heap);
+        free(sm.pending);
+        free(read_bufs);
+        free(out_bufs);
+        free(frames);
+        return -1;
+    }
+
+    out_init(&out, &sm, out_bufs);
+    if (compress)
+        out_compress(&out, frames);
+    out.file.fd = out_fd;
+    out.file.name = out_name;
+
+    int rc = 0;
+    for (int i = 0; i < nruns && rc == 0; i++)
+    {
+        struct sort_run *run = &sm.runs[i];
+        run->ctx = &runs[i];
+        run->ctx->next_read = 0;
+        for (int k = 0; k < 2; k++)
+        {
+            run->bufs[k].io.type = OP_RUN_READ;
+            run->bufs[k].io.ctx = run->ctx;
+            run->bufs[k].io.buf = read_bufs + ((size_t)i * 2 + k) * per_buf;
+        }
+        if (run_fill(&sm, i) < 0)
+            rc = -1;
+    }
+
+    // every run's first reads are queued before waiting on any of them
+    for (int i = 0; i < nruns && rc == 0; i++)
+    {
+        int more = run_next(&sm, i);
+        if (more < 0)
+            rc = -1;
+        else if (more)
+            sm.heap[sm.heap_len++] = i;
+    }
+    for (int i = sm.heap_len / 2 - 1; i >= 0 && rc == 0; i--)
+        heap_sift_down(&sm, i);
+
+    while (rc == 0 && sm.heap_len > 0)
+    {
+        int top = sm.heap[0];
+        struct sort_run *run = &sm.runs[top];
+        if (out_append(&out, run->rec, run->rec_len) < 0 || out_append(&out, "\n", 1) < 0)
+        {
+            rc = -1;
+            break;
+        }
+        int more = run_next(&sm, top);
+        if (more < 0)
+        {
+            rc = -1;
+            break;
+        }
+        if (!more)
+            sm.heap[0] = sm.heap[--sm.heap_len];
+        heap_sift_down(&sm, 0);
+    }
+    if (rc == 0 && out_finish(&out) < 0)
+        rc = -1;
+    if (rc != 0)
+        sort_drain(m);
+    *written = compress ? (off_t)out.raw_off : out.off;
+
+    for (int i = 0; i < nruns; i++)
+    {
+        close_input(&runs[i]);
+        free(sm.runs[i].carry);
+    }
+    free(sm.runs);
+    free(sm.heap);
+    free(sm.pending);
+    free(read_bufs);
+    free(out_bufs);
+    free(frames);
+    return rc;
+}
+
+/*
+ * Input order into a compressed output. Frames have to follow the raw byte
+ * order, so instead of the offset-based engines the inputs are streamed one
+ * after another through the sorted mode's read-ahead and double-buffered
+ * output; only the input being drained and the next one hold buffers.
+ */
+static int merge_compressed(struct merge *m, size_t mem, off_t *written)
+{
+    struct sort_merge sm;
+    struct out_stream out;
+    memset(&sm, 0, sizeof(sm));
+    sm.m = m;
+    sm.nruns = m->nfiles;
+
+    size_t per_buf = mem / 4;
+    if (per_buf > SORT_READ_AHEAD_MAX)
+        per_buf = SORT_READ_AHEAD_MAX;
+    if (per_buf < BUF_SIZE)
+        per_buf = BUF_SIZE;
+    sm.buf_size = (int)per_buf;
+
+    sm.runs = calloc((size_t)m->nfiles + 1, sizeof(*sm.runs));
+    sm.pending = calloc((size_t)m->nfiles + 1, sizeof(*sm.pending));
+    char *read_bufs = malloc(4 * per_buf);
+    char *out_bufs = malloc(2 * SORT_OUT_BUF_SIZE);
+    char *frames = malloc(2 * OUT_FRAME_SIZE);
+    if (!sm.runs || !sm.pending || !read_bufs || !out_bufs || !frames)
+    {
+        perror("malloc");
+        free(sm.runs);
+        free(sm.pending);
+        free(read_bufs);
+        free(out_bufs);
+        free(frames);
+        return -1;
+    }
+
+    out_init(&out, &sm, out_bufs);
+    out_compress(&out, frames);
+    out.file.fd = m->output_fd;
+    out.file.name = "output";
+
+    // input i reads into buffer pair i % 2, which input i - 2 has finished with
+    int rc = 0;
+    for (int i = 0; i < m->nfiles && i < 2 && rc == 0; i++)
+    {
+        struct sort_run *run = &sm.runs[i];
+        run->ctx = &m->ctxs[i];
+        for (int k = 0; k < 2; k++)
+        {
+            run->bufs[k].io.type = OP_RUN_READ;
+            run->bufs[k].io.ctx = run->ctx;
+            run->bufs[k].io.buf = read_bufs + ((size_t)(i % 2) * 2 + k) * per_buf;
+        }
+        rc = run_fill(&sm, i);
+    }
+
+    for (int i = 0; i < m->nfiles && rc == 0; i++)
+    {
+        struct sort_run *run = &sm.runs[i];
+        for (;;)
+        {
+            struct run_buf *b = &run->bufs[run->cur];
+            while (rc == 0 && (b->state == BUF_READING || (b->state == BUF_EMPTY && run->queued)))
+                rc = sort_wait(&sm);
+            if (rc != 0 || b->state == BUF_EMPTY)
+                break;
+            if (out_append(&out, b->io.buf, (size_t)b->io.len) < 0)
             {
-                // EOF
-                ctx->done = 1;
-                remaining_reads--;
+                rc = -1;
+                break;
             }
-            else
+            b->state = BUF_EMPTY;
+            run->cur ^= 1;
+            rc = run_fill(&sm, i);
+        }
+        close_input(run->ctx);
+
+        int next = i + 2;
+        if (rc == 0 && next < m->nfiles)
+        {
+            struct sort_run *nr = &sm.runs[next];
+            nr->ctx = &m->ctxs[next];
+            for (int k = 0; k < 2; k++)
             {
-                int bytes = cqe->res;
+                nr->bufs[k].io.type = OP_RUN_READ;
+                nr->bufs[k].io.ctx = nr->ctx;
+                nr->bufs[k].io.buf = run->bufs[k].io.buf;
+            }
+            rc = run_fill(&sm, next);
+        }
+    }
+    if (rc == 0 && out_finish(&out) < 0)
+        rc = -1;
+    if (rc != 0)
+        sort_drain(m);
+    *written = out.off;
 
-                // Submit async write
-                struct io_data *wdata = malloc(sizeof(*wdata));
-                wdata->type = OP_WRITE;
-                wdata->ctx = ctx;
-                wdata->len = bytes;
+    free(sm.runs);
+    free(sm.pending);
+    free(read_bufs);
+    free(out_bufs);
+    free(frames);
+    return rc;
+}
 
-                struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-                io_uring_prep_write(sqe, output_fd, ctx->buf, bytes, -1);
-                io_uring_sqe_set_data(sqe, wdata);
-                io_uring_submit(&ring);
-                pending_ops++;
+/* expand a compressed output back to plain bytes, one frame in memory at a time */
+static int decompress_file(const char *in_name, const char *out_name)
+{
+    int in = open(in_name, O_RDONLY);
+    if (in < 0)
+    {
+        fprintf(stderr, "open %s: %s\n", in_name, strerror(errno));
+        return -1;
+    }
+    int out = open(out_name, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        fprintf(stderr, "open %s: %s\n", out_name, strerror(errno));
+        close(in);
+        return -1;
+    }
 
-                // Next read
-                ctx->offset += bytes;
-                struct io_data *rdata = malloc(sizeof(*rdata));
-                rdata->type = OP_READ;
-                rdata->ctx = ctx;
-                rdata->offset = ctx->offset;
-                rdata->len = BUF_SIZE;
+    struct lzb_reader rd;
+    lzb_reader_init(&rd, in);
+    const uint8_t *block;
+    size_t len;
+    int ret, rc = 0;
+    while (rc == 0 && (ret = lzb_reader_next(&rd, &block, &len)) > 0)
+    {
+        for (size_t done = 0; done < len;)
+        {
+            ssize_t n = write(out, block + done, len - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                fprintf(stderr, "write %s: %s\n", out_name, strerror(errno));
+                rc = -1;
+                break;
+            }
+            stats_rw((uint64_t)n);
+            done += (size_t)n;
+        }
+    }
+    if (rc == 0 && ret < 0)
+    {
+        fprintf(stderr, "%s: not a complete compressed output\n", in_name);
+        rc = -1;
+    }
+    if (rc == 0 && rd.torn)
+    {
+        fprintf(stderr, "%s: truncated after %llu bytes\n", in_name, (unsigned long long)rd.raw_pos);
+        rc = -1;
+    }
+    if (rc == 0)
+        printf("Expanded %s into %s (%llu bytes).\n", in_name, out_name, (unsigned long long)rd.raw_pos);
+    lzb_reader_free(&rd);
+    close(in);
+    close(out);
+    return rc;
+}
+
+static int open_temp_run(const char *tmp_dir, char **name_out)
+{
+    static int seq;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/rmam-run.%d.%d", tmp_dir, (int)getpid(), seq++);
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    *name_out = strdup(path);
+    return fd;
+}
+
+static int add_run(struct file_ctx **runs, int *nruns, int *cap, char *name, off_t size)
+{
+    if (*nruns == *cap)
+    {
+        int new_cap = *cap ? *cap * 2 : 64;
+        struct file_ctx *p = realloc(*runs, (size_t)new_cap * sizeof(**runs));
+        if (!p)
+        {
+            perror("realloc");
+            return -1;
+        }
+        *runs = p;
+        *cap = new_cap;
+    }
+    struct file_ctx *run = &(*runs)[(*nruns)++];
+    memset(run, 0, sizeof(*run));
+    run->fd = -1;
+    run->name = name;
+    run->size = size;
+    run->temp = 1;
+    return 0;
+}
 
-                struct io_uring_sqe *sqe2 = io_uring_get_sqe(&ring);
-                io_uring_prep_read(sqe2, ctx->fd, ctx->buf, BUF_SIZE, ctx->offset);
-                io_uring_sqe_set_data(sqe2, rdata);
-                io_uring_submit(&ring);
-                pending_ops++;
+/* sort the complete records of the arena into a new run; the partial tail moves to the front */
+static int spill_run(struct out_stream *o, const char *tmp_dir, char *arena, size_t *fill,
+                     struct sort_rec **recs, size_t *recs_cap,
+                     struct file_ctx **runs, int *nruns, int *runs_cap)
+{
+    size_t nrec = 0, start = 0;
+    for (;;)
+    {
+        char *nl = memchr(arena + start, '\n', *fill - start);
+        if (!nl)
+            break;
+        if (nrec == *recs_cap)
+        {
+            size_t cap = *recs_cap ? *recs_cap * 2 : 1024;
+            struct sort_rec *p = realloc(*recs, cap * sizeof(**recs));
+            if (!p)
+            {
+                perror("realloc");
+                return -1;
             }
+            *recs = p;
+            *recs_cap = cap;
         }
-        // For writes, nothing special (just wait until all finish)
+        (*recs)[nrec].p = arena + start;
+        (*recs)[nrec].len = (size_t)(nl - (arena + start));
+        nrec++;
+        start = (size_t)(nl - arena) + 1;
+    }
+    if (nrec == 0)
+        return 0; // a single record fills the arena; the caller grows it
+
+    qsort(*recs, nrec, sizeof(**recs), sort_rec_cmp);
 
-        if (data)
-            free(data);
-        io_uring_cqe_seen(&ring, cqe);
-        pending_ops--;
+    // the previous run's last writes overlapped with filling this arena; finish them first
+    if (out_finish(o) < 0)
+        return -1;
+    if (o->file.fd >= 0)
+    {
+        (*runs)[*nruns - 1].size = o->off;
+        close(o->file.fd);
     }
+    char *name;
+    o->file.fd = open_temp_run(tmp_dir, &name);
+    if (o->file.fd < 0)
+        return -1;
+    o->file.name = name;
+    o->off = 0;
+    if (add_run(runs, nruns, runs_cap, name, 0) < 0)
+        return -1;
 
-    // Cleanup
-    for (int i = 0; i < MAX_FILES; i++)
+    for (size_t i = 0; i < nrec; i++)
+    {
+        if (out_append(o, (*recs)[i].p, (*recs)[i].len + 1) < 0) // records keep their newline
+            return -1;
+    }
+    if (out_flush(o) < 0)
+        return -1;
+
+    memmove(arena, arena + start, *fill - start);
+    *fill -= start;
+    return 0;
+}
+
+/* run generation: cut the inputs into sorted runs of at most run_mem bytes under tmp_dir */
+static int generate_runs(struct merge *m, size_t run_mem, const char *tmp_dir,
+                         struct file_ctx **runs, int *nruns, int *runs_cap)
+{
+    struct sort_merge sm;
+    struct out_stream out;
+    memset(&sm, 0, sizeof(sm));
+    sm.m = m;
+
+    size_t cap = run_mem, fill = 0;
+    char *arena = malloc(cap);
+    char *out_bufs = malloc(2 * SORT_OUT_BUF_SIZE);
+    struct sort_rec *recs = NULL;
+    size_t recs_cap = 0;
+    int rc = 0;
+    if (!arena || !out_bufs)
+    {
+        perror("malloc");
+        free(arena);
+        free(out_bufs);
+        return -1;
+    }
+    out_init(&out, &sm, out_bufs);
+
+    for (int i = 0; i < m->nfiles && rc == 0; i++)
+    {
+        struct file_ctx *ctx = &m->ctxs[i];
+        if (open_input(ctx) < 0)
+        {
+            rc = -1;
+            break;
+        }
+        for (;;)
+        {
+            if (fill == cap)
+            {
+                if (spill_run(&out, tmp_dir, arena, &fill, &recs, &recs_cap, runs, nruns, runs_cap) < 0)
+                {
+                    rc = -1;
+                    break;
+                }
+                if (fill == cap)
+                {
+                    // one record is longer than the arena: let it grow to hold it
+                    char *p = realloc(arena, cap * 2);
+                    if (!p)
+                    {
+                        perror("realloc");
+                        rc = -1;
+                        break;
+                    }
+                    arena = p;
+                    cap *= 2;
+                }
+            }
+            ssize_t n = read(ctx->fd, arena + fill, cap - fill);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                fprintf(stderr, "read %s: %s\n", ctx->name, strerror(errno));
+                rc = -1;
+                break;
+            }
+            stats_rw((uint64_t)n);
+            if (n == 0)
+                break;
+            fill += (size_t)n;
+        }
+        close_input(ctx);
+
+        // inputs never share a record: terminate a last line that has no newline
+        if (rc == 0 && fill > 0 && arena[fill - 1] != '\n')
+        {
+            if (fill == cap)
+            {
+                char *p = realloc(arena, cap + 1);
+                if (!p)
+                {
+                    perror("realloc");
+                    rc = -1;
+                    break;
+                }
+                arena = p;
+                cap++;
+            }
+            arena[fill++] = '\n';
+        }
+    }
+    if (rc == 0 && fill > 0)
+        rc = spill_run(&out, tmp_dir, arena, &fill, &recs, &recs_cap, runs, nruns, runs_cap);
+    if (rc == 0)
+        rc = out_finish(&out);
+    if (rc != 0)
+        sort_drain(m);
+    if (out.file.fd >= 0)
+    {
+        (*runs)[*nruns - 1].size = out.off;
+        close(out.file.fd);
+    }
+
+    free(recs);
+    free(arena);
+    free(out_bufs);
+    return rc;
+}
+
+static void remove_temp_runs(struct file_ctx *runs, int nruns)
+{
+    for (int i = 0; i < nruns; i++)
+    {
+        if (runs[i].temp)
+        {
+            unlink(runs[i].name);
+            free((char *)runs[i].name);
+            runs[i].temp = 0;
+        }
+    }
+}
+
+/*
+ * External sort/merge. With gen_runs the inputs are cut into sorted runs
+ * first; otherwise each input must already be sorted. More than SORT_FAN_IN
+ * runs are merged in passes through intermediate runs so open fds and
+ * read-ahead memory stay bounded.
+ */
+static int merge_sorted(struct merge *m, int gen_runs, size_t run_mem, const char *tmp_dir,
+                        const char *output_name, off_t *written, int *nruns_out)
+{
+    struct file_ctx *runs = NULL;
+    int nruns = 0, runs_cap = 0;
+    int rc = 0;
+
+    if (gen_runs)
+    {
+        stats_phase("runs");
+        rc = generate_runs(m, run_mem, tmp_dir, &runs, &nruns, &runs_cap);
+    }
+    else
+    {
+        runs = malloc((size_t)(m->nfiles ? m->nfiles : 1) * sizeof(*runs));
+        if (!runs)
+        {
+            perror("malloc");
+            return -1;
+        }
+        memcpy(runs, m->ctxs, (size_t)m->nfiles * sizeof(*runs));
+        nruns = runs_cap = m->nfiles;
+    }
+    *nruns_out = nruns;
+
+    while (rc == 0 && nruns > SORT_FAN_IN)
     {
-        close(ctxs[i].fd);
-        free(ctxs[i].buf);
+        struct file_ctx *next = NULL;
+        int nnext = 0, next_cap = 0;
+        for (int i = 0; i < nruns && rc == 0; i += SORT_FAN_IN)
+        {
+            int group = nruns - i < SORT_FAN_IN ? nruns - i : SORT_FAN_IN;
+            char *name;
+            off_t size = 0;
+            int fd = open_temp_run(tmp_dir, &name);
+            if (fd < 0 || add_run(&next, &nnext, &next_cap, name, 0) < 0)
+            {
+                rc = -1;
+                break;
+            }
+            stats_phase("merge pass");
+            rc = merge_runs(m, runs + i, group, run_mem, fd, name, 0, &size);
+            next[nnext - 1].size = size;
+            close(fd);
+            remove_temp_runs(runs + i, group);
+        }
+        if (rc != 0)
+            remove_temp_runs(next, nnext);
+        remove_temp_runs(runs, nruns);
+        free(runs);
+        runs = next;
+        nruns = nnext;
     }
-    close(output_fd);
-    io_uring_queue_exit(&ring);
 
-    printf("Merged into merged_output.txt (completion order).\n");
+    stats_phase("merge");
+    if (rc == 0)
+        rc = merge_runs(m, runs, nruns, run_mem, m->output_fd, output_name, m->compress, written);
+    remove_temp_runs(runs, nruns);
+    free(runs);
+    return rc;
+}
+
+static int add_input(const char ***names, int *count, int *cap, const char *name)
+{
+    if (*count == *cap)
+    {
+        int new_cap = *cap ? *cap * 2 : 64;
+        const char **p = realloc(*names, (size_t)new_cap * sizeof(**names));
+        if (!p)
+        {
+            perror("realloc");
+            return -1;
+        }
+        *names = p;
+        *cap = new_cap;
+    }
+    (*names)[(*count)++] = name;
     return 0;
 }
 
+/* one path per line; blank lines are skipped */
+static int read_list_file(const char *list_path, const char ***names, int *count, int *cap)
+{
+    FILE *f = fopen(list_path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "open %s: %s\n", list_path, strerror(errno));
+        return -1;
+    }
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+    int rc = 0;
+    while (rc == 0 && (n = getline(&line, &line_cap, f)) > 0)
+    {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+            line[--n] = '\0';
+        if (n == 0)
+            continue;
+        char *name = strdup(line);
+        if (!name || add_input(names, count, cap, name) < 0)
+            rc = -1;
+    }
+    free(line);
+    fclose(f);
+    return rc;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [input ...]\n"
+            "  -o, --output FILE  merged output (default merged_output.txt)\n"
+            "  -l, --list FILE    also merge the paths listed in FILE, one per line, after argv inputs\n"
+            "  -q, --depth N      io_uring entries and the cap on ops in flight (default %d)\n"
+            "  -e, --engine E     auto, copy, splice or buffered (default auto)\n"
+            "      auto      copy_file_range, falling back to splice, then buffered\n"
+            "      copy      copy_file_range only; shares extents on reflink filesystems\n"
+            "      splice    io_uring IORING_OP_SPLICE through a pipe per active input\n"
+            "      buffered  io_uring reads into a kernel-provided buffer ring, writes back out\n"
+            "      --no-buf-ring      buffered engine: one fixed buffer per context instead of the ring\n"
+            "  -s, --sorted       inputs are sorted runs of lines; k-way merge them in byte order\n"
+            "  -g, --gen-runs     external sort: cut unsorted inputs into sorted runs first (implies -s)\n"
+            "  -m, --run-mem SIZE run generation arena and merge read-ahead budget (default 64M)\n"
+            "  -T, --tmp-dir DIR  where run files go (default .)\n"
+            "  -z, --compress     write the output as independently decodable compressed blocks\n"
+            "  -x, --decompress F expand compressed output F into the -o file and exit\n"
+            "Without inputs, merges file1.txt file2.txt file3.txt.\n",
+            prog, DEFAULT_QUEUE_DEPTH);
+}
+
+int main(int argc, char **argv)
+{
+    enum engine engine = ENGINE_AUTO;
+    const char *output_name = "merged_output.txt";
+    const char *list_path = NULL;
+    unsigned depth = DEFAULT_QUEUE_DEPTH;
+    int sorted = 0, gen_runs = 0;
+    uint64_t run_mem = DEFAULT_RUN_MEM;
+    const char *tmp_dir = ".";
+    int no_buf_ring = 0;
+    int compress = 0;
+    const char *expand = NULL;
+
+    static const struct option long_opts[] = {
+        {"output", required_argument, NULL, 'o'},
+        {"list", required_argument, NULL, 'l'},
+        {"depth", required_argument, NULL, 'q'},
+        {"engine", required_argument, NULL, 'e'},
+        {"sorted", no_argument, NULL, 's'},
+        {"gen-runs", no_argument, NULL, 'g'},
+        {"run-mem", required_argument, NULL, 'm'},
+        {"tmp-dir", required_argument, NULL, 'T'},
+        {"no-buf-ring", no_argument, NULL, 'R'},
+        {"compress", no_argument, NULL, 'z'},
+        {"decompress", required_argument, NULL, 'x'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:l:q:e:sgm:T:zx:h", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            output_name = optarg;
+            break;
+        case 'l':
+            list_path = optarg;
+            break;
+        case 'q':
+            depth = (unsigned)strtoul(optarg, NULL, 10);
+            if (depth < 2)
+                depth = 2; // a splice pair needs two entries
+            break;
+        case 'e':
+            if (strcmp(optarg, "auto") == 0)
+                engine = ENGINE_AUTO;
+            else if (strcmp(optarg, "copy") == 0)
+                engine = ENGINE_COPY;
+            else if (strcmp(optarg, "splice") == 0)
+                engine = ENGINE_SPLICE;
+            else if (strcmp(optarg, "buffered") == 0)
+                engine = ENGINE_BUFFERED;
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            sorted = 1;
+            break;
+        case 'g':
+            sorted = gen_runs = 1;
+            break;
+        case 'm':
+            if (parse_size(optarg, &run_mem) < 0 || run_mem < 2 * BUF_SIZE)
+            {
+                fprintf(stderr, "bad run memory size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'T':
+            tmp_dir = optarg;
+            break;
+        case 'R':
+            no_buf_ring = 1;
+            break;
+        case 'z':
+            compress = 1;
+            break;
+        case 'x':
+            expand = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (expand)
+    {
+        stats_init(argv[0], "expand");
+        return decompress_file(expand, output_name) < 0 ? 1 : 0;
+    }
+
+    const char **input_files = NULL;
+    int nfiles = 0, cap = 0;
+    for (int i = optind; i < argc; i++)
+    {
+        if (add_input(&input_files, &nfiles, &cap, argv[i]) < 0)
+            return 1;
+    }
+    if (list_path && read_list_file(list_path, &input_files, &nfiles, &cap) < 0)
+        return 1;
+    if (nfiles == 0)
+    {
+        static const char *defaults[] = {"file1.txt", "file2.txt", "file3.txt"};
+        for (int i = 0; i < 3; i++)
+        {
+            if (add_input(&input_files, &nfiles, &cap, defaults[i]) < 0)
+                return 1;
+        }
+    }
+
+    stats_init(argv[0], "setup");
+
+    struct merge m;
+    memset(&m, 0, sizeof(m));
+    m.depth = depth;
+    m.nfiles = nfiles;
+    m.no_buf_ring = no_buf_ring;
+    m.compress = compress;
+    int ret = io_uring_queue_init(depth, &m.ring, 0);
+    if (ret < 0)
+    {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        return 1;
+    }
+
+    // One context per op the ring can hold, allocated once up front; the buffered
+    // engine attaches read buffers to them only if it runs
+    m.pool = calloc(depth, sizeof(*m.pool));
+    m.ctxs = calloc((size_t)nfiles, sizeof(*m.ctxs));
+    if (!m.pool || !m.ctxs)
+    {
+        perror("malloc");
+        return 1;
+    }
+    for (unsigned i = 0; i < depth; i++)
+        pool_put(&m, &m.pool[i]);
+
+    m.output_fd = open(output_name, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (m.output_fd < 0)
+    {
+        perror("open output");
+        return 1;
+    }
+
+    // Size every input up front so each one knows where it lands in the output;
+    // the inputs themselves are opened only while an engine works on them
+    off_t total = 0;
+    for (int i = 0; i < nfiles; i++)
+    {
+        struct stat st;
+        if (stat(input_files[i], &st) < 0)
+        {
+            fprintf(stderr, "stat %s: %s\n", input_files[i], strerror(errno));
+            return 1;
+        }
+        m.ctxs[i].fd = -1;
+        m.ctxs[i].name = input_files[i];
+        m.ctxs[i].size = st.st_size;
+        m.ctxs[i].out_base = total;
+        total += st.st_size;
+    }
+
+    if (sorted)
+    {
+        off_t written = 0;
+        int nruns = 0;
+        int rc = merge_sorted(&m, gen_runs, (size_t)run_mem, tmp_dir, output_name, &written, &nruns);
+        close(m.output_fd);
+        io_uring_queue_exit(&m.ring);
+        free(m.ctxs);
+        free(m.pool_bufs);
+        free(m.pool);
+        if (rc != 0)
+            return 1;
+        printf("Merged %d inputs into %s (sorted, %d runs, %lld bytes", nfiles, output_name, nruns,
+               (long long)written);
+        struct stat st;
+        if (compress && stat(output_name, &st) == 0)
+            printf(", compressed to %lld", (long long)st.st_size);
+        printf(").\n");
+        return 0;
+    }
+
+    if (compress)
+    {
+        stats_phase("merge");
+        off_t written = 0;
+        int rc = merge_compressed(&m, (size_t)run_mem, &written);
+        for (int i = 0; i < nfiles; i++)
+            close_input(&m.ctxs[i]);
+        close(m.output_fd);
+        io_uring_queue_exit(&m.ring);
+        free(m.ctxs);
+        free(m.pool);
+        if (rc != 0)
+            return 1;
+        printf("Merged %d inputs into %s (input order, %lld bytes, compressed to %lld).\n", nfiles,
+               output_name, (long long)total, (long long)written);
+        return 0;
+    }
+
+    if (ftruncate(m.output_fd, total) < 0)
+    {
+        perror("ftruncate output");
+        return 1;
+    }
+
+    // Each engine leaves ctx->copied where it stopped, so a fallback only moves what is left
+    stats_phase("merge");
+    int rc = MERGE_UNSUPPORTED;
+    const char *used = engine_name(engine);
+    if (engine == ENGINE_AUTO || engine == ENGINE_COPY)
+    {
+        rc = merge_copy_range(&m);
+        used = engine_name(ENGINE_COPY);
+    }
+    if (rc == MERGE_UNSUPPORTED && (engine == ENGINE_AUTO || engine == ENGINE_SPLICE))
+    {
+        rc = merge_splice(&m);
+        used = engine_name(ENGINE_SPLICE);
+    }
+    if (rc == MERGE_UNSUPPORTED && (engine == ENGINE_AUTO || engine == ENGINE_BUFFERED))
+    {
+        rc = merge_buffered(&m);
+        used = m.ring_bufs ? "buffered, provided buffer ring" : engine_name(ENGINE_BUFFERED);
+    }
+    if (rc == MERGE_UNSUPPORTED)
+        fprintf(stderr, "%s is not supported for these files\n", engine_name(engine));
+
+    // Cleanup
+    for (int i = 0; i < nfiles; i++)
+        close_input(&m.ctxs[i]);
+    close(m.output_fd);
+    io_uring_queue_exit(&m.ring);
+    free(m.ctxs);
+    free(m.pool_bufs);
+    free(m.pool);
+
+    if (rc != 0)
+        return 1;
+    printf("Merged %d inputs into %s (input order, %lld bytes, %s).\n", nfiles, output_name,
+           (long long)total, used);
+    return 0;
+}
@@ -11,9 +11,27 @@
 #include <sys/types.h>
 #include <limits.h>
 #include <ctype.h>
+#include <pthread.h>
 
+#include "io_stats.h"
+#include "lz_block.h"
+
+#define WAL_PATH "wal_log.txt"
+#define WAL_BLOCK (64 * 1024) // raw bytes a compressed frame collects before it must be written
+#define WAL_SHARD_FMT "wal_shard.%d"
+#define MAX_SHARDS 64
+
+/*
+ * Transaction ids double as the LSN: mt-load threads draw them from this
+ * counter, so ids in different shards still order commits globally.
+ */
 static int g_tid = 1;
 
+int next_tid(void)
+{
+    return __atomic_fetch_add(&g_tid, 1, __ATOMIC_RELAXED);
+}
+
 void fatal(const char *msg)
 {
     perror(msg);
@@ -33,6 +51,7 @@ ssize_t write_all(int fd, const void *buf, size_t count)
             if (errno == EINTR) continue;
             return -1;
         }
+        stats_rw((uint64_t)w);
         left -= (size_t)w;
         p += w;
     }
@@ -45,6 +64,7 @@ void append_and_sync(int fd, const char *text)
     size_t len = strlen(text);
     if (write_all(fd, text, len) != (ssize_t)len)
         fatal("write failed");
+    stats_fsync();
     if (fsync(fd) != 0)
         fatal("fsync failed");
 }
@@ -57,20 +77,139 @@ void append_only(int fd, const char *text)
         fatal("write failed");
 }
 
+/*
+ * The WAL is either plain text, one write (and in sync mode one fsync) per
+ * record, or a stream of lz_block frames. A compressed WAL stages records in
+ * memory and writes them as one frame at each commit point: only committed
+ * transactions are ever replayed, so making BEGIN and SET durable on their
+ * own buys nothing, and a frame of many transactions is what compresses.
+ */
+typedef struct {
+    int fd;
+    bool compress;
+    uint64_t raw_off;  /* raw stream offset of the first staged byte */
+    uint8_t *stage;
+    size_t fill;
+    uint8_t *frame;    /* LZB_HDR_SIZE + lzb_bound(WAL_BLOCK) */
+} wal_writer;
+
+/* `appending`: the command will add records, so the file's format must match */
+void wal_open(wal_writer *w, const char *path, bool compress, bool appending)
+{
+    memset(w, 0, sizeof(*w));
+    w->compress = compress;
+    w->fd = open(path, O_CREAT | O_APPEND | O_RDWR, 0644);
+    if (w->fd < 0) fatal("wal fd not opened");
+    if (!appending)
+    {
+        w->compress = false;
+        return;
+    }
+
+    uint8_t magic[4];
+    bool framed = pread(w->fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) &&
+                  lzb_get_le32(magic) == LZB_MAGIC;
+    struct stat st;
+    if (fstat(w->fd, &st) < 0) fatal("fstat wal");
+    if (!compress)
+    {
+        if (framed)
+        {
+            fprintf(stderr, "%s is compressed; pass -z to append to it\n", path);
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    if (st.st_size > 0 && !framed)
+    {
+        fprintf(stderr, "%s holds plain records; reset it before writing compressed\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    off_t end = 0;
+    int ret = lzb_scan_end(w->fd, &end, &w->raw_off);
+    if (ret < 0)
+    {
+        fprintf(stderr, "%s: damaged frame stream\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (ret == 1)
+    {
+        /* a crash mid-append left a partial frame; it never committed anything */
+        fprintf(stderr, "%s: dropping a torn frame at byte %lld\n", path, (long long)end);
+        if (ftruncate(w->fd, end) < 0) fatal("ftruncate wal");
+    }
+    w->stage = malloc(WAL_BLOCK);
+    w->frame = malloc(LZB_HDR_SIZE + lzb_bound(WAL_BLOCK));
+    if (!w->stage || !w->frame) fatal("malloc");
+}
+
+/* write the staged records as one frame */
+void wal_flush(wal_writer *w, bool sync)
+{
+    if (!w->compress)
+    {
+        if (sync)
+        {
+            stats_fsync();
+            if (fsync(w->fd) != 0) fatal("fsync failed");
+        }
+        return;
+    }
+    if (w->fill > 0)
+    {
+        size_t len = lzb_encode_frame(w->frame, w->stage, (uint32_t)w->fill, w->raw_off);
+        if (write_all(w->fd, w->frame, len) != (ssize_t)len)
+            fatal("write failed");
+        w->raw_off += w->fill;
+        w->fill = 0;
+    }
+    if (sync)
+    {
+        stats_fsync();
+        if (fsync(w->fd) != 0) fatal("fsync failed");
+    }
+}
+
+/* one record; plain WALs write it now (and fsync it if `sync`), compressed ones stage it */
+void wal_record(wal_writer *w, const char *text, bool sync)
+{
+    if (!w->compress)
+    {
+        if (sync) append_and_sync(w->fd, text);
+        else append_only(w->fd, text);
+        return;
+    }
+    size_t len = strlen(text);
+    if (w->fill + len > WAL_BLOCK)
+        wal_flush(w, false);
+    memcpy(w->stage + w->fill, text, len);
+    w->fill += len;
+}
+
+void wal_close(wal_writer *w)
+{
+    wal_flush(w, false);
+    close(w->fd);
+    free(w->stage);
+    free(w->frame);
+}
+
 /* write with sync: wal entries are synced and DB write is synced too */
-void write_with_sync(int wal_fd, int db_fd, int key, int value)
+void write_with_sync(wal_writer *wal, int db_fd, int key, int value)
 {
     char buf[256];
-    int tid = g_tid++;
+    int tid = next_tid();
 
     snprintf(buf, sizeof(buf), "TRANSACTION %d BEGIN\n", tid);
-    append_and_sync(wal_fd, buf);
+    wal_record(wal, buf, true);
 
     snprintf(buf, sizeof(buf), "SET %d %d\n", key, value);
-    append_and_sync(wal_fd, buf);
+    wal_record(wal, buf, true);
 
     snprintf(buf, sizeof(buf), "TRANSACTION %d COMMIT\n", tid);
-    append_and_sync(wal_fd, buf);
+    wal_record(wal, buf, true);
+    if (wal->compress) wal_flush(wal, true);
 
     /* Apply to DB and sync */
     snprintf(buf, sizeof(buf), "key=%d value=%d\n", key, value);
@@ -80,42 +219,73 @@ void write_with_sync(int wal_fd, int db_fd, int key, int value)
 }
 
 /* write to WAL without fsync (fast but risky) */
-void write_with_nosync(int wal_fd, int key, int value)
+void write_with_nosync(wal_writer *wal, int key, int value)
 {
     char buf[256];
-    int tid = g_tid++;
+    int tid = next_tid();
 
     snprintf(buf, sizeof(buf), "TRANSACTION %d BEGIN\n", tid);
-    append_only(wal_fd, buf);
+    wal_record(wal, buf, false);
 
     snprintf(buf, sizeof(buf), "SET %d %d\n", key, value);
-    append_only(wal_fd, buf);
+    wal_record(wal, buf, false);
 
     snprintf(buf, sizeof(buf), "TRANSACTION %d COMMIT\n", tid);
-    append_only(wal_fd, buf);
+    wal_record(wal, buf, false);
 
     printf("WAL write (no sync) complete: key=%d value=%d\n", key, value);
 }
 
 /* simulate crash after WAL has been synced (before DB apply) */
-void crash_after_wal(int wal_fd, int key, int value)
+void crash_after_wal(wal_writer *wal, int key, int value)
 {
     char buf[256];
-    int tid = g_tid++;
+    int tid = next_tid();
 
     snprintf(buf, sizeof(buf), "TRANSACTION %d BEGIN\n", tid);
-    append_and_sync(wal_fd, buf);
+    wal_record(wal, buf, true);
 
     snprintf(buf, sizeof(buf), "SET %d %d\n", key, value);
-    append_and_sync(wal_fd, buf);
+    wal_record(wal, buf, true);
 
     snprintf(buf, sizeof(buf), "TRANSACTION %d COMMIT\n", tid);
-    append_and_sync(wal_fd, buf);
+    wal_record(wal, buf, true);
+    if (wal->compress) wal_flush(wal, true);
 
     printf("Simulated crash after WAL (before DB apply). Exiting now.\n");
+    stats_finish();
     _exit(1); /* use _exit to simulate abrupt termination */
 }
 
+/*
+ * many transactions without fsync per record; the WAL is synced every
+ * WAL_BLOCK raw bytes (group commit) and once at the end
+ */
+void load(wal_writer *wal, int count)
+{
+    char buf[256];
+    size_t since_sync = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int tid = next_tid();
+        int len = snprintf(buf, sizeof(buf), "TRANSACTION %d BEGIN\nSET %d %d\nTRANSACTION %d COMMIT\n",
+                           tid, i, i * 7, tid);
+        wal_record(wal, buf, false);
+        since_sync += (size_t)len;
+        if (since_sync >= WAL_BLOCK)
+        {
+            wal_flush(wal, true);
+            since_sync = 0;
+        }
+    }
+    wal_flush(wal, true);
+
+    struct stat st;
+    if (fstat(wal->fd, &st) < 0) fatal("fstat wal");
+    printf("Loaded %d transactions; %s is %lld bytes%s\n", count, WAL_PATH, (long long)st.st_size,
+           wal->compress ? " (compressed)" : "");
+}
+
 /* simple dynamic array for SET records during a transaction */
 typedef struct {
     int key;
@@ -144,94 +314,467 @@ void kv_push(kv_vec *v, int k, int val)
 }
 void kv_free(kv_vec *v) { free(v->items); v->items = NULL; v->len = v->cap = 0; }
 
-/* Perform recovery: apply all SETs from committed transactions */
-void recover(int db_fd)
+/* line-at-a-time replay state, fed from either WAL format */
+typedef struct {
+    char line[512];
+    size_t line_pos;
+    int in_txn;
+    int tid;          /* id from the BEGIN line of the current transaction */
+    bool committed;   /* kvs holds a whole committed transaction, not yet applied */
+    kv_vec kvs;
+    int db_fd;
+} wal_replay;
+
+void replay_line(wal_replay *r)
 {
-    int wal_fd = open("wal_log.txt", O_RDONLY);
-    if (wal_fd < 0) {
-        if (errno == ENOENT) {
-            printf("No wal_log.txt found, nothing to recover.\n");
-            return;
+    r->line[r->line_pos] = '\0';
+
+    /* Trim leading spaces */
+    char *s = r->line;
+    while (*s && isspace((unsigned char)*s)) s++;
+
+    if (strncmp(s, "TRANSACTION", 11) == 0 && strstr(s, "BEGIN")) {
+        r->in_txn = 1;
+        if (sscanf(s + 11, "%d", &r->tid) != 1) r->tid = 0;
+        kv_free(&r->kvs);
+        kv_init(&r->kvs);
+    }
+    else if (strncmp(s, "SET", 3) == 0 && r->in_txn) {
+        /* parse "SET <key> <value>" robustly using sscanf */
+        int key = 0, value = 0;
+        if (sscanf(s + 3, "%d %d", &key, &value) == 2) {
+            kv_push(&r->kvs, key, value);
+        } else {
+            fprintf(stderr, "Warning: malformed SET line in WAL: '%s'\n", s);
         }
-        fatal("open wal_log.txt for read failed");
+    }
+    else if (strncmp(s, "TRANSACTION", 11) == 0 && strstr(s, "COMMIT") && r->in_txn) {
+        r->in_txn = 0;
+        r->committed = true;
     }
 
-    /* rewind */
-    if (lseek(wal_fd, 0, SEEK_SET) < 0) fatal("lseek wal_fd");
+    /* reset line buffer */
+    r->line_pos = 0;
+}
 
-    char buf[512];
-    ssize_t n;
-    char line[512];
-    size_t line_pos = 0;
+/* apply all SETs of the transaction that just committed */
+void replay_apply(wal_replay *r)
+{
+    for (size_t j = 0; j < r->kvs.len; j++) {
+        char out[256];
+        snprintf(out, sizeof(out), "key=%d value=%d\n", r->kvs.items[j].key, r->kvs.items[j].value);
+        append_and_sync(r->db_fd, out);
+        printf("Recovered: key=%d value=%d\n", r->kvs.items[j].key, r->kvs.items[j].value);
+    }
+    r->committed = false;
+    kv_free(&r->kvs);
+    kv_init(&r->kvs);
+}
 
-    int in_txn = 0;
-    kv_vec kvs;
-    kv_init(&kvs);
+/* consume bytes up to and including the line that commits a transaction */
+size_t replay_scan(wal_replay *r, const char *buf, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        char c = buf[i];
+        if (c == '\n')
+        {
+            replay_line(r);
+            if (r->committed) return i + 1;
+        }
+        else
+        {
+            if (r->line_pos < sizeof(r->line) - 1)
+            {
+                r->line[r->line_pos++] = c;
+            }
+        }
+    }
+    return n;
+}
+
+/* true if fd holds lz_block frames rather than text */
+bool wal_is_compressed(int fd)
+{
+    uint8_t magic[4];
+    return pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) && lzb_get_le32(magic) == LZB_MAGIC;
+}
+
+/*
+ * Hand every raw WAL byte to `sink`, decompressing frame by frame so a
+ * compressed log never has to fit in memory. Returns the number of torn
+ * frames skipped at the end (0 or 1).
+ */
+int wal_stream(int wal_fd, void (*sink)(void *, const char *, size_t), void *arg)
+{
+    if (!wal_is_compressed(wal_fd))
+    {
+        char buf[512];
+        ssize_t n;
+        while ((n = read(wal_fd, buf, sizeof(buf))) > 0)
+        {
+            stats_rw((uint64_t)n);
+            sink(arg, buf, (size_t)n);
+        }
+        if (n < 0) fatal("read wal_fd");
+        return 0;
+    }
+
+    struct lzb_reader rd;
+    lzb_reader_init(&rd, wal_fd);
+    const uint8_t *block;
+    size_t len;
+    int ret;
+    while ((ret = lzb_reader_next(&rd, &block, &len)) > 0)
+    {
+        stats_op(len);
+        sink(arg, (const char *)block, len);
+    }
+    if (ret < 0) fatal("read compressed wal");
+    lzb_reader_free(&rd);
+    return rd.torn;
+}
+
+/* pull-style reader over one log, stopping at each committed transaction */
+typedef struct {
+    int fd;
+    bool compress;
+    struct lzb_reader rd;
+    char buf[4096];
+    const char *data;
+    size_t len, pos;
+    wal_replay r;
+    bool done;
+} log_cursor;
+
+void shard_path(char *buf, size_t size, int idx)
+{
+    snprintf(buf, size, WAL_SHARD_FMT, idx);
+}
 
-    while ((n = read(wal_fd, buf, sizeof(buf))) > 0)
+/* false if `path` does not exist */
+bool log_open(log_cursor *c, const char *path, int db_fd)
+{
+    memset(c, 0, sizeof(*c));
+    c->fd = open(path, O_RDONLY);
+    if (c->fd < 0) {
+        if (errno == ENOENT) return false;
+        fatal("open wal for read failed");
+    }
+    c->compress = wal_is_compressed(c->fd);
+    if (c->compress) lzb_reader_init(&c->rd, c->fd);
+    kv_init(&c->r.kvs);
+    c->r.db_fd = db_fd;
+    return true;
+}
+
+/* move to the next committed transaction (c->r.tid, c->r.kvs); false at the end */
+bool log_next(log_cursor *c)
+{
+    while (!c->done)
     {
-        for (ssize_t i = 0; i < n; i++)
+        if (c->pos == c->len)
         {
-            char c = buf[i];
-            if (c == '\n')
+            if (c->compress)
             {
-                line[line_pos] = '\0';
-
-                /* Trim leading spaces */
-                char *s = line;
-                while (*s && isspace((unsigned char)*s)) s++;
-
-                if (strncmp(s, "TRANSACTION", 11) == 0 && strstr(s, "BEGIN")) {
-                    in_txn = 1;
-                    kv_free(&kvs);
-                    kv_init(&kvs);
-                }
-                else if (strncmp(s, "SET", 3) == 0 && in_txn) {
-                    /* parse "SET <key> <value>" robustly using sscanf */
-                    int key = 0, value = 0;
-                    if (sscanf(s + 3, "%d %d", &key, &value) == 2) {
-                        kv_push(&kvs, key, value);
-                    } else {
-                        fprintf(stderr, "Warning: malformed SET line in WAL: '%s'\n", s);
-                    }
-                }
-                else if (strncmp(s, "TRANSACTION", 11) == 0 && strstr(s, "COMMIT") && in_txn) {
-                    /* apply all SETs seen in this transaction */
-                    for (size_t j = 0; j < kvs.len; j++) {
-                        char out[256];
-                        snprintf(out, sizeof(out), "key=%d value=%d\n", kvs.items[j].key, kvs.items[j].value);
-                        append_and_sync(db_fd, out);
-                        printf("Recovered: key=%d value=%d\n", kvs.items[j].key, kvs.items[j].value);
-                    }
-                    in_txn = 0;
-                    kv_free(&kvs);
-                    kv_init(&kvs);
-                }
-
-                /* reset line buffer */
-                line_pos = 0;
+                const uint8_t *block;
+                size_t len;
+                int ret = lzb_reader_next(&c->rd, &block, &len);
+                if (ret < 0) fatal("read compressed wal");
+                if (ret == 0) break;
+                stats_op(len);
+                c->data = (const char *)block;
+                c->len = len;
             }
             else
             {
-                if (line_pos < sizeof(line) - 1)
-                {
-                    line[line_pos++] = c;
-                }
+                ssize_t n = read(c->fd, c->buf, sizeof(c->buf));
+                if (n < 0) fatal("read wal");
+                if (n == 0) break;
+                stats_rw((uint64_t)n);
+                c->data = c->buf;
+                c->len = (size_t)n;
             }
+            c->pos = 0;
         }
+        c->pos += replay_scan(&c->r, c->data + c->pos, c->len - c->pos);
+        if (c->r.committed) return true;
+    }
+    c->done = true;
+    return false;
+}
+
+void log_close(log_cursor *c)
+{
+    if (c->compress) lzb_reader_free(&c->rd);
+    close(c->fd);
+    kv_free(&c->r.kvs);
+}
+
+/* highest id on any TRANSACTION line in buf; a first line that may be cut off is skipped */
+int max_tid_in(const char *buf, size_t n, bool whole_first_line)
+{
+    int last = -1;
+    size_t i = 0;
+    if (!whole_first_line)
+    {
+        while (i < n && buf[i] != '\n') i++;
+        i++;
+    }
+    while (i < n)
+    {
+        size_t end = i;
+        while (end < n && buf[end] != '\n') end++;
+        int tid;
+        if (end - i > 11 && strncmp(buf + i, "TRANSACTION", 11) == 0 && sscanf(buf + i + 11, "%d", &tid) == 1 &&
+            tid > last)
+            last = tid;
+        i = end + 1;
+    }
+    return last;
+}
+
+/*
+ * Highest transaction id in the log at `path`, 0 if there is none. Ids only
+ * grow along a log, so the last records are enough: the last whole frame
+ * of a compressed log, a growing tail window of a plain one. Walking the
+ * whole log is only the fallback when the tail holds no id.
+ */
+int log_last_tid(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    int last = -1;
+    if (wal_is_compressed(fd))
+    {
+        uint8_t *raw;
+        size_t len;
+        int ret = lzb_read_last(fd, LZB_HDR_SIZE + lzb_bound(WAL_BLOCK), &raw, &len);
+        if (ret < 0) fatal("read wal tail");
+        if (ret > 0)
+        {
+            last = max_tid_in((const char *)raw, len, true);
+            free(raw);
+        }
+    }
+    else
+    {
+        struct stat st;
+        if (fstat(fd, &st) < 0) fatal("fstat wal");
+        for (off_t window = 4096; last < 0; window *= 2)
+        {
+            off_t from = st.st_size > window ? st.st_size - window : 0;
+            size_t n = (size_t)(st.st_size - from);
+            char *buf = malloc(n ? n : 1);
+            if (!buf) fatal("malloc");
+            if (pread(fd, buf, n, from) != (ssize_t)n) fatal("read wal tail");
+            stats_rw(n);
+            last = max_tid_in(buf, n, from == 0);
+            free(buf);
+            if (from == 0) break;
+        }
+    }
+    close(fd);
+
+    if (last < 0)
+    {
+        log_cursor *c = malloc(sizeof(*c));
+        if (!c) fatal("malloc");
+        if (log_open(c, path, -1))
+        {
+            while (log_next(c))
+            {
+                if (c->r.tid > last) last = c->r.tid;
+                c->r.committed = false;
+            }
+            log_close(c);
+        }
+        free(c);
+    }
+    return last < 0 ? 0 : last;
+}
+
+/* highest transaction id in wal_log.txt and every shard, so new ones sort after it */
+int logs_last_tid(void)
+{
+    int last = log_last_tid(WAL_PATH);
+    for (int i = 0; i < MAX_SHARDS; i++)
+    {
+        char path[64];
+        shard_path(path, sizeof(path), i);
+        if (access(path, F_OK) != 0) break;
+        int t = log_last_tid(path);
+        if (t > last) last = t;
+    }
+    return last;
+}
+
+/*
+ * Perform recovery: apply all SETs from committed transactions. wal_log.txt
+ * and each shard are in LSN order on their own, so committing the smallest
+ * head of all logs at every step replays them in global commit order. Only
+ * one transaction per log is held in memory.
+ */
+void recover(int db_fd)
+{
+    log_cursor *cs = calloc(MAX_SHARDS + 1, sizeof(*cs));
+    if (!cs) fatal("calloc");
+    int n = 0;
+    bool have_wal = log_open(&cs[n], WAL_PATH, db_fd);
+    if (have_wal) log_next(&cs[n++]);
+    for (int i = 0; i < MAX_SHARDS; i++)
+    {
+        char path[64];
+        shard_path(path, sizeof(path), i);
+        if (!log_open(&cs[n], path, db_fd)) break;
+        log_next(&cs[n++]);
+    }
+    if (n == 0)
+    {
+        printf("No wal_log.txt found, nothing to recover.\n");
+        free(cs);
+        return;
     }
-    if (n < 0) fatal("read wal_fd");
-    close(wal_fd);
-    kv_free(&kvs);
+
+    long applied = 0;
+    for (;;)
+    {
+        int best = -1;
+        for (int i = 0; i < n; i++)
+        {
+            if (cs[i].r.committed && (best < 0 || cs[i].r.tid < cs[best].r.tid)) best = i;
+        }
+        if (best < 0) break;
+        replay_apply(&cs[best].r);
+        applied++;
+        log_next(&cs[best]);
+    }
+
+    int torn = 0;
+    for (int i = 0; i < n; i++)
+    {
+        torn += cs[i].compress && cs[i].rd.torn;
+        log_close(&cs[i]);
+    }
+    free(cs);
+    if (n > 1 || !have_wal)
+        printf("Merged %s%d WAL shard(s) in commit order: %ld transactions.\n", have_wal ? "wal_log.txt and " : "",
+               n - have_wal, applied);
+    if (torn > 0) printf("Ignored a torn frame at the end of %d log(s).\n", torn);
     printf("Recovery complete.\n");
 }
 
+typedef struct {
+    wal_writer *wal;
+    pthread_mutex_t *lock;  /* set when every thread appends to the one WAL */
+    int count;
+} mt_worker;
+
+/*
+ * Single-record transactions, each committed with its own fsync. Keys
+ * collide across threads on purpose so that recovery only ends up with the
+ * right values if it replays shards in LSN order.
+ */
+void *mt_worker_run(void *arg)
+{
+    mt_worker *mw = arg;
+    char buf[256];
+    for (int i = 0; i < mw->count; i++)
+    {
+        if (mw->lock) pthread_mutex_lock(mw->lock);
+        int tid = next_tid();
+        snprintf(buf, sizeof(buf), "TRANSACTION %d BEGIN\nSET %d %d\nTRANSACTION %d COMMIT\n",
+                 tid, i % 64, tid, tid);
+        wal_record(mw->wal, buf, false);
+        wal_flush(mw->wal, true);
+        if (mw->lock) pthread_mutex_unlock(mw->lock);
+    }
+    return NULL;
+}
+
+/*
+ * `threads` committers, either one WAL shard each (own fd, own fsync) or
+ * all serialized on wal_log.txt, which is what a single log amounts to.
+ */
+void mt_load(bool compress, int threads, int count, bool shared)
+{
+    if (threads < 1 || threads > MAX_SHARDS)
+    {
+        fprintf(stderr, "threads must be 1..%d\n", MAX_SHARDS);
+        exit(EXIT_FAILURE);
+    }
+    int nwals = shared ? 1 : threads;
+    wal_writer *wals = calloc((size_t)nwals, sizeof(*wals));
+    mt_worker *workers = calloc((size_t)threads, sizeof(*workers));
+    pthread_t *tids = calloc((size_t)threads, sizeof(*tids));
+    if (!wals || !workers || !tids) fatal("calloc");
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    if (shared)
+    {
+        wal_open(&wals[0], WAL_PATH, compress, true);
+    }
+    else
+    {
+        for (int i = 0; i < nwals; i++)
+        {
+            char path[64];
+            shard_path(path, sizeof(path), i);
+            wal_open(&wals[i], path, compress, true);
+        }
+    }
+
+    long long start = now_ns();
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].wal = &wals[shared ? 0 : i];
+        workers[i].lock = shared ? &lock : NULL;
+        workers[i].count = count;
+        if (pthread_create(&tids[i], NULL, mt_worker_run, &workers[i]) != 0) fatal("pthread_create");
+    }
+    for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+    double secs = (double)(now_ns() - start) / 1e9;
+
+    long total = (long)threads * count;
+    printf("mt-load: %d threads x %d commits on %s: %.0f commits/s, %.1f us per commit\n", threads, count,
+           shared ? "one shared WAL" : "one shard per thread", secs > 0 ? total / secs : 0.0,
+           total > 0 ? secs * 1e6 / total : 0.0);
+
+    for (int i = 0; i < nwals; i++) wal_close(&wals[i]);
+    free(wals);
+    free(workers);
+    free(tids);
+}
+
+void stdout_sink(void *arg, const char *buf, size_t n)
+{
+    (void)arg;
+    fwrite(buf, 1, n, stdout);
+}
+
 /* display wal and db */
 void display_wal_db()
 {
     printf("=== WAL LOG ===\n");
     fflush(stdout);
-    system("cat wal_log.txt 2>/dev/null || true");
+    int wal_fd = open(WAL_PATH, O_RDONLY);
+    if (wal_fd >= 0)
+    {
+        /* a compressed WAL is shown as the records it holds */
+        wal_stream(wal_fd, stdout_sink, NULL);
+        close(wal_fd);
+    }
+    for (int i = 0; i < MAX_SHARDS; i++)
+    {
+        char path[64];
+        shard_path(path, sizeof(path), i);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) break;
+        printf("\n=== WAL SHARD %d ===\n", i);
+        fflush(stdout);
+        wal_stream(fd, stdout_sink, NULL);
+        close(fd);
+    }
     printf("\n=== DB FILE ===\n");
     fflush(stdout);
     system("cat db.txt 2>/dev/null || true");
@@ -243,7 +786,13 @@ void reset_files()
 {
     unlink("wal_log.txt");
     unlink("db.txt");
-    printf("wal_log.txt and db.txt removed (if they existed).\n");
+    for (int i = 0; i < MAX_SHARDS; i++)
+    {
+        char path[64];
+        shard_path(path, sizeof(path), i);
+        unlink(path);
+    }
+    printf("wal_log.txt, wal_shard.* and db.txt removed (if they existed).\n");
 }
 
 /* validate integer token */
@@ -278,52 +827,87 @@ int validate_integer(const char *token, const char *what)
 
 int main(int argc, char **argv)
 {
+    const char *prog = argv[0];
+    bool compress = false;
+    if (argc > 1 && (strcmp(argv[1], "-z") == 0 || strcmp(argv[1], "--compress") == 0))
+    {
+        compress = true;
+        argv++;
+        argc--;
+    }
+
     if (argc < 2)
     {
         fprintf(stderr,
             "Usage:\n"
-            "  %s write <key> <value>\n"
-            "  %s write-nosync <key> <value>\n"
-            "  %s crash-after-wal <key> <value>\n"
+            "  %s [-z] write <key> <value>\n"
+            "  %s [-z] write-nosync <key> <value>\n"
+            "  %s [-z] crash-after-wal <key> <value>\n"
+            "  %s [-z] load <count>\n"
+            "  %s [-z] mt-load <threads> <count> [shared]\n"
             "  %s recover\n"
             "  %s display\n"
-            "  %s reset\n",
-            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+            "  %s reset\n"
+            "-z, --compress writes the WAL as compressed frames, one per commit\n"
+            "(load: per %d KiB group); recover and display read either format.\n"
+            "mt-load commits from each thread into its own wal_shard.N, or with\n"
+            "`shared` into wal_log.txt; recover merges the shards by transaction id.\n",
+            prog, prog, prog, prog, prog, prog, prog, prog, WAL_BLOCK / 1024);
         return 1;
     }
 
+    stats_init(prog, "open");
+
     if (strcmp(argv[1], "reset") == 0) {
         reset_files();
         return 0;
     }
 
     /* open WAL and DB (create if missing). Use O_APPEND to append. */
-    int wal_fd = open("wal_log.txt", O_CREAT | O_APPEND | O_WRONLY, 0644);
-    if (wal_fd < 0) fatal("wal fd not opened");
+    const char *cmd = argv[1];
+    bool appending = strcmp(cmd, "write") == 0 || strcmp(cmd, "write-nosync") == 0 ||
+                     strcmp(cmd, "crash-after-wal") == 0 || strcmp(cmd, "load") == 0;
+    wal_writer wal;
+    wal_open(&wal, WAL_PATH, compress, appending);
+    /* new transaction ids continue after every log's, so recover() can order them all */
+    if (appending || strcmp(cmd, "mt-load") == 0) g_tid = logs_last_tid() + 1;
 
     int db_fd = open("db.txt", O_CREAT | O_APPEND | O_WRONLY, 0644);
     if (db_fd < 0) fatal("db fd not opened");
 
+    stats_phase(argv[1]);
     if (strcmp(argv[1], "write") == 0)
     {
         if (argc < 4) fatal("Need key and value");
         int key = validate_integer(argv[2], "key");
         int value = validate_integer(argv[3], "value");
-        write_with_sync(wal_fd, db_fd, key, value);
+        write_with_sync(&wal, db_fd, key, value);
     }
     else if (strcmp(argv[1], "write-nosync") == 0)
     {
         if (argc < 4) fatal("Need key and value");
         int key = validate_integer(argv[2], "key");
         int value = validate_integer(argv[3], "value");
-        write_with_nosync(wal_fd, key, value);
+        write_with_nosync(&wal, key, value);
     }
     else if (strcmp(argv[1], "crash-after-wal") == 0)
     {
         if (argc < 4) fatal("Need key and value");
         int key = validate_integer(argv[2], "key");
         int value = validate_integer(argv[3], "value");
-        crash_after_wal(wal_fd, key, value);
+        crash_after_wal(&wal, key, value);
+    }
+    else if (strcmp(argv[1], "load") == 0)
+    {
+        if (argc < 3) fatal("Need a transaction count");
+        load(&wal, validate_integer(argv[2], "count"));
+    }
+    else if (strcmp(argv[1], "mt-load") == 0)
+    {
+        if (argc < 4) fatal("Need a thread count and a per-thread transaction count");
+        int threads = validate_integer(argv[2], "threads");
+        int count = validate_integer(argv[3], "count");
+        mt_load(compress, threads, count, argc > 4 && strcmp(argv[4], "shared") == 0);
     }
     else if (strcmp(argv[1], "recover") == 0)
     {
@@ -339,7 +923,7 @@ int main(int argc, char **argv)
         printf("Unknown command: %s\n", argv[1]);
     }
 
-    close(wal_fd);
+    wal_close(&wal);
     close(db_fd);
     return 0;
 }
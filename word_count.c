@@ -1,20 +1,43 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "io_stats.h"
+#include "placement.h"
 
 #define THREAD_COUNT 4   // you can change this to any number of threads
+#define MIN_CHUNK (64 * 1024) // smaller appends are counted by fewer threads
 
-// Shared global counter
-int total_words = 0;
-pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Running totals for the input, as kept in the --state file
+typedef struct {
+    unsigned long long dev, ino; // which file the offset belongs to
+    long long offset;            // bytes counted so far
+    long long words;
+    int in_word;                 // the byte before offset was part of a word
+} count_state_t;
 
 // Struct to pass thread work info
 typedef struct {
-    char* buffer;   // the file contents
+    char* buffer;   // the bytes being counted; buffer[0] is file offset `base`
     long start;     // start index for this thread
     long end;       // end index for this thread
     int tid;        // thread id (for printing)
+    int fd;         // >= 0: read [start, end) into the buffer here (first touch)
+    long long base;
+    const struct placement* place;
+
+    // results
+    long long count;    // word starts in the chunk, as if a separator came before it
+    int first_in_word;  // the chunk begins inside a word
+    int last_in_word;   // the chunk ends inside a word
+    int failed;         // first touch only: the read hit an error (-1) or end of file (1)
 } thread_arg_t;
 
 // Function: check if char is separator
@@ -29,88 +52,392 @@ void* count_words(void* arg) {
     long start = data->start;
     long end = data->end;
 
-    int local_count = 0;
+    place_pin(data->place, data->tid - 1);
+    if (data->fd >= 0) {
+        // this thread faults its own part of the buffer in, so it lands on this thread's node
+        for (long off = start; off < end; ) {
+            ssize_t n = pread(data->fd, buf + off, (size_t)(end - off), data->base + off);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                if (n < 0) {
+                    perror("pread");
+                }
+                data->failed = n < 0 ? -1 : 1;
+                return NULL;
+            }
+            stats_rw((uint64_t)n);
+            off += n;
+        }
+    }
+
+    // Words are counted where they start, so one that straddles a chunk (or
+    // an earlier run's offset) is only counted once after the caller stitches
+    // the chunks together with first_in_word/last_in_word.
+    long long local_count = 0;
     int in_word = 0;
 
     for (long i = start; i < end; i++) {
         if (is_separator(buf[i])) {
-            if (in_word) {
+            in_word = 0;
+        } else {
+            if (!in_word) {
                 local_count++;
-                in_word = 0;
             }
-        } else {
             in_word = 1;
         }
     }
 
-    // Handle last word if it ends at boundary
-    if (in_word) {
-        local_count++;
-    }
-
     // Print per-thread result
-    printf("[Thread %d] counted %d words in range [%ld - %ld)\n",
-           data->tid, local_count, start, end);
+    printf("[Thread %d] counted %lld words in range [%lld - %lld)\n",
+           data->tid, local_count, data->base + start, data->base + end);
 
-    // Update global total (protected by mutex)
-    pthread_mutex_lock(&count_mutex);
-    total_words += local_count;
-    pthread_mutex_unlock(&count_mutex);
+    stats_ops(1, (uint64_t)(end - start));
 
-    free(data);
+    data->count = local_count;
+    data->first_in_word = end > start && !is_separator(buf[start]);
+    data->last_in_word = in_word;
     return NULL;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <filename>\n", argv[0]);
-        return 1;
+/*
+ * Count bytes [st->offset, st->offset + len) of the file and fold them into
+ * st. Small ranges use fewer threads; each range gets its own buffer so a
+ * follow loop only ever holds the bytes of one append. Returns 1 and leaves
+ * st alone if the file ended before len bytes (it was truncated meanwhile).
+ */
+static int count_range(FILE* f, long long len, struct placement* place, count_state_t* st) {
+    if (len <= 0) {
+        return 0;
     }
 
-    // Open file
-    FILE* f = fopen(argv[1], "r");
-    if (!f) {
-        perror("fopen");
-        return 1;
+    stats_phase("read");
+    int first_touch = place->bind == PLACE_FIRST_TOUCH;
+    struct place_buf buf;
+    if (place_alloc(place, &buf, (size_t)len + 1, 0) < 0) {
+        perror("buffer mmap");
+        return -1;
+    }
+    char* buffer = (char*)buf.mem;
+    if (!first_touch) {
+        for (long long off = 0; off < len; ) {
+            ssize_t n = pread(fileno(f), buffer + off, (size_t)(len - off), st->offset + off);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                if (n < 0) {
+                    perror("pread");
+                }
+                place_free(&buf);
+                return n < 0 ? -1 : 1;
+            }
+            stats_rw((uint64_t)n);
+            off += n;
+        }
+        buffer[len] = '\0';
     }
-
-    // Find file size
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    // Read file into memory
-    char* buffer = malloc(fsize + 1);
-    fread(buffer, 1, fsize, f);
-    buffer[fsize] = '\0';
-    fclose(f);
 
     // Create threads
+    stats_phase("count");
+    int nthreads = len / MIN_CHUNK + 1 < THREAD_COUNT ? (int)(len / MIN_CHUNK + 1) : THREAD_COUNT;
     pthread_t threads[THREAD_COUNT];
-    long chunk = fsize / THREAD_COUNT;
+    thread_arg_t args[THREAD_COUNT];
+    long chunk = (long)(len / nthreads);
 
-    for (int i = 0; i < THREAD_COUNT; i++) {
-        thread_arg_t* arg = malloc(sizeof(thread_arg_t));
+    int started = 0, err = 0;
+    for (int i = 0; i < nthreads; i++) {
+        thread_arg_t* arg = &args[i];
+        memset(arg, 0, sizeof(*arg));
         arg->buffer = buffer;
         arg->start = i * chunk;
-        arg->end = (i == THREAD_COUNT - 1) ? fsize : (i + 1) * chunk;
+        arg->end = (i == nthreads - 1) ? (long)len : (i + 1) * chunk;
         arg->tid = i + 1;
+        arg->fd = first_touch ? fileno(f) : -1;
+        arg->base = st->offset;
+        arg->place = place;
 
-        pthread_create(&threads[i], NULL, count_words, arg);
+        if ((err = pthread_create(&threads[i], NULL, count_words, arg)) != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+        started++;
     }
 
-    // Join threads
-    for (int i = 0; i < THREAD_COUNT; i++) {
+    int failed = err ? -1 : 0;
+    for (int i = 0; i < started; i++) {
         pthread_join(threads[i], NULL);
+        if (args[i].failed && failed >= 0) {
+            failed = args[i].failed;
+        }
+    }
+    if (failed) {
+        place_free(&buf);
+        return failed;
     }
 
-    // Print result
-    printf("\nTotal words in file = %d\n", total_words);
+    // Take back the word each chunk boundary split in two
+    int in_word = st->in_word;
+    for (int i = 0; i < nthreads; i++) {
+        st->words += args[i].count - (args[i].first_in_word && in_word);
+        if (args[i].end > args[i].start) {
+            in_word = args[i].last_in_word;
+        }
+    }
+    st->in_word = in_word;
+    st->offset += len;
 
-    // Cleanup
-    free(buffer);
-    pthread_mutex_destroy(&count_mutex);
+    place_report(stdout, place, &buf);
+    place_free(&buf);
+    return 0;
+}
 
+// Returns 0 and leaves st zeroed when there is no state file yet
+static int load_state(const char* path, count_state_t* st) {
+    memset(st, 0, sizeof(*st));
+    FILE* sf = fopen(path, "r");
+    if (!sf) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror(path);
+        return -1;
+    }
+    int ok = fscanf(sf, "word_count-state 1 dev=%llu ino=%llu offset=%lld words=%lld in_word=%d",
+                    &st->dev, &st->ino, &st->offset, &st->words, &st->in_word) == 5;
+    fclose(sf);
+    if (!ok) {
+        fprintf(stderr, "%s: not a word_count state file\n", path);
+        return -1;
+    }
     return 0;
 }
 
+// Written to a temporary file and renamed, so a crash leaves the old state or the new one
+static int save_state(const char* path, const count_state_t* st) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* sf = fopen(tmp, "w");
+    if (!sf) {
+        perror("open state");
+        return -1;
+    }
+    fprintf(sf, "word_count-state 1 dev=%llu ino=%llu offset=%lld words=%lld in_word=%d\n",
+            st->dev, st->ino, st->offset, st->words, st->in_word);
+    if (fflush(sf) != 0 || fsync(fileno(sf)) != 0) {
+        perror("write state");
+        fclose(sf);
+        return -1;
+    }
+    stats_fsync();
+    fclose(sf);
+    if (rename(tmp, path) != 0) {
+        perror("rename state");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Count whatever was appended since st->offset. A different inode or a file
+ * shorter than the offset means the input was replaced or truncated, and
+ * the count starts over from byte 0.
+ */
+static int catch_up(FILE* f, struct placement* place, count_state_t* st, const char* state_path) {
+    struct stat sb;
+    long long before, from;
+    int rc;
+    // a short read means the file shrank after the fstat (copytruncate rotation): look again
+    do {
+        if (fstat(fileno(f), &sb) < 0) {
+            perror("fstat");
+            return -1;
+        }
+        if (st->dev != (unsigned long long)sb.st_dev || st->ino != (unsigned long long)sb.st_ino ||
+            sb.st_size < st->offset) {
+            if (st->offset > 0) {
+                printf("Input was replaced or truncated; counting from byte 0\n");
+            }
+            memset(st, 0, sizeof(*st));
+            st->dev = (unsigned long long)sb.st_dev;
+            st->ino = (unsigned long long)sb.st_ino;
+        }
+
+        before = st->words;
+        from = st->offset;
+        rc = count_range(f, sb.st_size - st->offset, place, st);
+    } while (rc > 0);
+    if (rc < 0) {
+        return -1;
+    }
+    if (st->offset > from) {
+        printf("Counted bytes [%lld - %lld): +%lld words\n", from, st->offset, st->words - before);
+    }
+    if (state_path && save_state(state_path, st) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Watch for appends. Set up before the first catch_up(), so a write landing
+ * while the existing bytes are being counted still leaves an event behind.
+ */
+static int watch_input(const char* path) {
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0) {
+        perror("inotify_init1");
+        return -1;
+    }
+    if (inotify_add_watch(ifd, path, IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) < 0) {
+        perror("inotify_add_watch");
+        close(ifd);
+        return -1;
+    }
+    return ifd;
+}
+
+/*
+ * Count appends as inotify reports them on ifd, until the file is deleted or
+ * renamed away (log rotation); the bytes written before that are counted
+ * first. Exits on a signal, and with --state nothing counted is lost.
+ */
+static int follow(int ifd, FILE* f, const char* path, struct placement* place, count_state_t* st,
+                  const char* state_path) {
+    printf("Following %s (%lld words so far)\n", path, st->words);
+    fflush(stdout);
+
+    int rc = 0, gone = 0;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (rc == 0 && !gone) {
+        ssize_t n = read(ifd, events, sizeof(events));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("read inotify");
+            rc = -1;
+            break;
+        }
+        stats_syscalls(1);
+        // one count per batch of events: many small appends coalesce into one range
+        for (char* p = events; p < events + n; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) {
+                gone = 1;
+            }
+            p += sizeof(*ev) + ev->len;
+        }
+        rc = catch_up(f, place, st, state_path);
+        // our open fd keeps a deleted file alive, so IN_DELETE_SELF only comes after we stop;
+        // the unlink itself shows up as IN_ATTRIB with the link count at 0
+        struct stat sb;
+        if (fstat(fileno(f), &sb) == 0 && sb.st_nlink == 0) {
+            gone = 1;
+        }
+        printf("Total words in file = %lld\n", st->words);
+        fflush(stdout);
+    }
+    if (gone) {
+        printf("%s was moved or deleted; stopped following\n", path);
+    }
+    return rc;
+}
+
+static void usage(const char* prog) {
+    printf("Usage: %s [options] <filename>\n"
+           "  --cpu LIST         pin worker i to the i-th CPU of LIST (e.g. 0-3 or 0,2,4,6)\n"
+           "  --mem-bind MODE    first-touch (each worker reads its own chunk), local, dev or a node number\n"
+           "  --huge-pages MODE  back the file buffer with none, thp or hugetlb pages\n"
+           "  --state FILE       resume from the offset, count and in-word flag in FILE and\n"
+           "                     save them back, so a rerun counts only appended bytes\n"
+           "  --follow           keep counting appends as inotify reports them\n",
+           prog);
+}
+
+int main(int argc, char* argv[]) {
+    struct placement place;
+    place_init(&place);
+    const char* state_path = NULL;
+    int follow_mode = 0;
+
+    static const struct option long_opts[] = {
+        {"cpu",        required_argument, NULL, 'c'},
+        {"mem-bind",   required_argument, NULL, 'm'},
+        {"huge-pages", required_argument, NULL, 'g'},
+        {"state",      required_argument, NULL, 's'},
+        {"follow",     no_argument,       NULL, 'f'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:m:g:s:fh", long_opts, NULL)) != -1) {
+        int bad = 0;
+        switch (opt) {
+        case 'c': bad = place_parse_cpus(&place, optarg) < 0; break;
+        case 'm': bad = place_parse_bind(&place, optarg) < 0; break;
+        case 'g': bad = place_parse_huge(&place, optarg) < 0; break;
+        case 's': state_path = optarg; break;
+        case 'f': follow_mode = 1; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+        if (bad) {
+            fprintf(stderr, "bad value for --%s: %s\n", opt == 'c' ? "cpu" : opt == 'm' ? "mem-bind" : "huge-pages",
+                    optarg);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char* path = argv[optind];
+
+    stats_init(argv[0], "read");
+
+    // Open file
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        perror("fopen");
+        return 1;
+    }
+
+    count_state_t st;
+    if (state_path && load_state(state_path, &st) < 0) {
+        return 1;
+    }
+    if (!state_path) {
+        memset(&st, 0, sizeof(st));
+    }
+    if (st.offset > 0) {
+        printf("Resuming at byte %lld with %lld words\n", st.offset, st.words);
+    }
+
+    // pinned before any buffer exists, so "local" means this CPU's node
+    place_pin(&place, 0);
+    place_resolve(&place, fileno(f));
+
+    int ifd = -1;
+    if (follow_mode && (ifd = watch_input(path)) < 0) {
+        return 1;
+    }
+
+    int rc = catch_up(f, &place, &st, state_path);
+    if (rc == 0) {
+        // Print result
+        printf("\nTotal words in file = %lld\n", st.words);
+    }
+    if (rc == 0 && follow_mode) {
+        rc = follow(ifd, f, path, &place, &st, state_path);
+    }
+    if (ifd >= 0) {
+        close(ifd);
+    }
+
+    // Cleanup
+    fclose(f);
+    return rc == 0 ? 0 : 1;
+}
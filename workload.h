@@ -0,0 +1,192 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+/*
+ * Op stream shared by the I/O benchmarks: which block to touch next and
+ * whether it is a read or a write. The sequence depends only on the
+ * pattern, the read percentage and the seed, so posix_io, io_uring and
+ * io_bench replay identical workloads for the same arguments.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "bench_common.h"
+
+enum access_pattern {
+    PATTERN_SEQ,
+    PATTERN_UNIFORM,
+    PATTERN_ZIPF
+};
+
+#define ZIPF_DEFAULT_THETA 0.99
+
+/*
+ * Zipfian ranks in [0, n) after Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases" (the generator YCSB uses). Setup is
+ * O(n) for zeta(n); each sample is O(1). Ranks are spread over the file with
+ * a multiplicative permutation so the hot set is not just the first blocks.
+ */
+struct zipf_gen {
+    uint64_t n;
+    double theta, alpha, zetan, eta;
+    uint64_t scatter;
+};
+
+static inline uint64_t wl_gcd(uint64_t a, uint64_t b)
+{
+    while (b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Gray et al.'s generator is only a zipf distribution for 0 < theta < 1 */
+static inline int zipf_theta_valid(double theta)
+{
+    return theta > 0 && theta < 1;
+}
+
+static inline void zipf_init(struct zipf_gen *z, uint64_t n, double theta)
+{
+    double zeta2 = 1.0 + pow(0.5, theta);
+
+    z->n = n;
+    z->theta = theta;
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= n; i++) z->zetan += 1.0 / pow((double)i, theta);
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+
+    // any multiplier coprime with n gives a bijection on [0, n)
+    z->scatter = n > 1 ? (0x9E3779B97F4A7C15ULL % n) | 1 : 1;
+    while (n > 1 && wl_gcd(z->scatter, n) != 1) z->scatter += 2;
+}
+
+static inline uint64_t zipf_next(struct zipf_gen *z, struct bench_rng *rng)
+{
+    double u = rng_double(rng);
+    double uz = u * z->zetan;
+    uint64_t rank;
+
+    if (uz < 1.0) rank = 0;
+    else if (uz < 1.0 + pow(0.5, z->theta)) rank = 1;
+    else rank = (uint64_t)((double)z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    if (rank >= z->n) rank = z->n - 1;
+
+    return (uint64_t)(((unsigned __int128)rank * z->scatter) % z->n);
+}
+
+struct io_op {
+    off_t offset;
+    bool is_read;
+};
+
+struct op_gen {
+    enum access_pattern pattern;
+    unsigned read_pct;       // 0..100, share of ops that are reads
+    uint64_t block_size;
+    uint64_t nblocks;        // offsets are drawn from [0, nblocks)
+    uint64_t total_ops;
+    uint64_t issued;
+    struct bench_rng rng;
+    struct zipf_gen zipf;
+};
+
+static inline void op_gen_init(struct op_gen *g, enum access_pattern pattern, unsigned read_pct,
+                               uint64_t block_size, uint64_t nblocks, uint64_t total_ops,
+                               double zipf_theta, uint64_t seed)
+{
+    memset(g, 0, sizeof(*g));
+    g->pattern = pattern;
+    g->read_pct = read_pct > 100 ? 100 : read_pct;
+    g->block_size = block_size;
+    g->nblocks = nblocks;
+    g->total_ops = total_ops;
+    rng_seed(&g->rng, seed);
+    if (pattern == PATTERN_ZIPF) zipf_init(&g->zipf, nblocks, zipf_theta);
+}
+
+static inline bool op_next(struct op_gen *g, struct io_op *op)
+{
+    if (g->issued == g->total_ops) return false;
+
+    uint64_t block;
+    switch (g->pattern) {
+    case PATTERN_UNIFORM: block = rng_below(&g->rng, g->nblocks); break;
+    case PATTERN_ZIPF:    block = zipf_next(&g->zipf, &g->rng); break;
+    default:              block = g->issued % g->nblocks; break;
+    }
+    op->offset = (off_t)(block * g->block_size);
+    op->is_read = g->read_pct > 0 && rng_below(&g->rng, 100) < g->read_pct;
+    g->issued++;
+    return true;
+}
+
+static inline int parse_pattern(const char *s, enum access_pattern *out)
+{
+    if (strcmp(s, "seq") == 0) *out = PATTERN_SEQ;
+    else if (strcmp(s, "rand") == 0 || strcmp(s, "uniform") == 0) *out = PATTERN_UNIFORM;
+    else if (strcmp(s, "zipf") == 0) *out = PATTERN_ZIPF;
+    else return -1;
+    return 0;
+}
+
+static inline const char *pattern_name(enum access_pattern p)
+{
+    switch (p) {
+    case PATTERN_UNIFORM: return "uniform";
+    case PATTERN_ZIPF:    return "zipf";
+    default:              return "seq";
+    }
+}
+
+/* extend the file to `bytes` of real data so reads never hit holes or EOF */
+static inline int prefill_file(const char *path, uint64_t bytes)
+{
+    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) {
+        perror("open prefill");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat prefill");
+        close(fd);
+        return -1;
+    }
+    if ((uint64_t)st.st_size >= bytes) {
+        close(fd);
+        return 0;
+    }
+
+    static unsigned char chunk[1 << 20];
+    for (size_t i = 0; i < sizeof(chunk); i++) chunk[i] = (unsigned char)(i & 0xFF);
+
+    for (uint64_t off = (uint64_t)st.st_size; off < bytes; off += sizeof(chunk)) {
+        size_t n = bytes - off < sizeof(chunk) ? (size_t)(bytes - off) : sizeof(chunk);
+        if (pwrite(fd, chunk, n, (off_t)off) != (ssize_t)n) {
+            perror("pwrite prefill");
+            close(fd);
+            return -1;
+        }
+    }
+    if (fsync(fd) < 0) {
+        perror("fsync prefill");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+#endif